@@ -14,10 +14,10 @@
  *
  */
 
-#define VERSION "0.33"
-
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
@@ -33,11 +33,28 @@
 #include <sys/stat.h>
 #include <signal.h>
 #include <math.h>
+#include <ctype.h>
 #include <sys/types.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <limits.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
 
 #include "stats64.h"
 #include "libnetlink.h"
+#include "libifstat2.h"
+
+#define VERSION IFSTAT2_VERSION
+#include <linux/gen_stats.h>
+#include <linux/pkt_sched.h>
 #include <linux/netdevice.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <linux/net_namespace.h>
 
 struct {
 	int scan_interval;
@@ -47,13 +64,56 @@ struct {
 	int noformat;
 	int verbose;
 	int foreground;
+	int sort_key;		/* counter index, -1 keeps table order */
+	int topn;
+	int rollup;
+	int backend;
+	int nominal;		/* Mbit/s of links without a speed */
+	char *profile;		/* client, estimator profile */
+	char *token;		/* client, baseline */
+	int util;		/* show utilization */
+	int cpu;		/* daemon pinned to, -1 not */
+	int rtprio;		/* daemon SCHED_FIFO priority, 0 not */
+	char *logdir;		/* sample log segments */
+	time_t from, to;	/* client, range queried from the log */
+	char *relay;		/* daemon, ADDR:PORT of the aggregator */
+	char *relay_name;	/* its name there, the hostname if NULL */
+	char *aggregate;	/* [ADDR:]PORT to run the aggregator on */
+	char *hub;		/* client, ADDR:PORT of the aggregator */
+	char *key;		/* -K, relays and the aggregator */
+	int oneshot;		/* ms between two samples, no daemon */
 } conf;
 
-double W;
+enum { BK_NETLINK, BK_PROCDEV };
+
 char **patterns;
 int npatterns;
 
+/*
+   Compiled globs. Most patterns are a name or a literal prefix and
+   '*', which never reach fnmatch(); the others only once their literal
+   prefix matched. A set keeps its generation while its patterns stay
+   the same, entries cache their result against it.
+*/
+enum { PAT_NAME, PAT_PREFIX, PAT_GLOB };
+
+struct pat {
+	char *glob;
+	int kind;
+	int plen;		/* literal prefix */
+};
+
+struct matcher {
+	struct pat *pat;
+	int n;
+	unsigned gen;
+};
+
+static unsigned matcher_gen;
+struct matcher pmatch;		/* of patterns */
+
 char info_source[128];
+char base_info[64];	/* client, "TOKEN MS" or "TOKEN new" */
 
 /* Keep in sync */
 
@@ -64,575 +124,5605 @@ char info_source[128];
 
 #define MAXS (sizeof(struct ifstats64)/sizeof(uint64_t))
 
+/* Sort and rule keys past the counters, percent of link speed */
+#define K_RX_UTIL	MAXS
+#define K_TX_UTIL	(MAXS+1)
+#define NKEYS		(MAXS+2)
+#define SAT_PCT		90
+
+/* Counter names in struct ifstats64 order, for -s */
+static const char *counter_names[] = {
+	"rx_packets", "tx_packets", "rx_bytes", "tx_bytes",
+	"rx_errors", "tx_errors", "rx_dropped", "tx_dropped",
+	"multicast", "collisions",
+	"rx_length_errors", "rx_over_errors", "rx_crc_errors",
+	"rx_frame_errors", "rx_fifo_errors", "rx_missed_errors",
+	"tx_aborted_errors", "tx_carrier_errors", "tx_fifo_errors",
+	"tx_heartbeat_errors", "tx_window_errors",
+	"rx_compressed", "tx_compressed",
+};
+
+static const struct {
+	const char *name;
+	int idx;
+} counter_alias[] = {
+	{ "rx_pps", 0 }, { "tx_pps", 1 },
+	{ "rx_bits", 2 }, { "tx_bits", 3 },
+	{ "rx_drop", 6 }, { "tx_drop", 7 },
+	{ "rx_util", K_RX_UTIL }, { "tx_util", K_TX_UTIL },
+};
+
+#define MAX_RULES 16
+
+/* A match result, valid while gen is the matcher's */
+struct mcache {
+	unsigned gen;
+	unsigned bits;
+};
+
 struct ifstat_ent
 {
 	struct ifstat_ent	*next;
+	struct ifstat_ent	*hnext;		/* idx_hash chain */
 	char			*name;
 	int			ifindex;
+	int			master;		/* IFLA_MASTER */
+	int			link;		/* IFLA_LINK, same netns only */
+	int			peerns;		/* IFLA_LINK_NETNSID + 1, 0 none */
+	int			members;	/* rollups */
+	unsigned		groups;		/* group membership bits */
+	unsigned		rules;		/* rules matching name */
+	struct mcache		pm, wm, gm;	/* patterns, watched, groups */
+	unsigned		flags;
+	unsigned		lflags;		/* ifi_flags */
+	unsigned		lchanges;	/* IFLA_CARRIER_CHANGES */
+	int			speed;		/* Mbit/s, 0 unknown */
+	int			duplex;
+	double			util[2];	/* rx, tx % of speed */
+	double			*erate;		/* extra estimators */
+	int			nerate;
+	uint64_t		escan;		/* scan erate is of */
+	uint64_t		stamp;		/* sample time, us */
+	unsigned char		rcount[MAX_RULES]; /* scans rule held */
+	unsigned char		quiet;		/* scans without a change */
 	uint64_t                val[MAXS];
 	double			rate[MAXS];
 };
 
 
+#define IFE_SEEN	1	/* matched by the scan being merged */
+#define IFE_SPEED	2	/* speed queried */
+#define IFE_SAT		4	/* utilization >= SAT_PCT */
+#define IFE_RATED	8	/* rate holds a sample, not the zero start */
+
 struct ifstat_ent *kern_db;
+struct ifstat_ent *roll_db;
 
-int ewma;
-int overflow;
+/*
+   Estimator profiles. Slot 0 is the daemon's own, n->rate, set on
+   its command line. Clients name others with -P, or get one named
+   after their -d/-t. Each keeps rates per entry in n->erate, a MAXS
+   row per extra slot, derived from the same samples; the daemon
+   samples at the finest interval asked for. Profiles belong to the
+   uid that set them up, another user's -P NAME gets a profile of its
+   own. They are held by the users that selected them and freed
+   EST_TTL after their last query once no one holds them.
+*/
+#define MAX_EST 8
+#define EST_TTL 300
+#define MIN_SCAN 100	/* ms */
+
+struct est {
+	char name[32];		/* empty when free */
+	uid_t uid;		/* owner */
+	int scan_interval;	/* ms, 0 for any */
+	int time_constant;	/* ms */
+	int refs;
+	time_t last;
+	uint64_t born;		/* first scan */
+} est[MAX_EST];
+int nest = 1;		/* slots in use are below */
+int scan_ms;		/* sampling interval */
 
-static int match(char *id)
-{
-	int i;
+/*
+   A daemon run as root serves every user, authenticated by
+   SO_PEERCRED. Each uid holds the profile it last used for up to
+   USER_TTL.
+*/
+#define USER_TTL 3600
+#define MAX_USERS 64
+
+struct user {
+	uid_t uid;
+	int est;
+	time_t last;
+} users[MAX_USERS];
+int nusers;
+
+/* ifindex lookup into kern_db, rebuilt by hash_db() */
+#define IDX_HSIZE 4096
+static struct ifstat_ent *idx_hash[IDX_HSIZE];
+
+/* User defined rollup groups, -g NAME=PATTERN[,PATTERN] */
+#define MAX_GROUPS 32
+
+struct group {
+	char *name;
+	char **patterns;
+	int npatterns;
+	struct matcher m;
+} groups[MAX_GROUPS];
+int ngroups;
 
-	if (npatterns == 0)
-		return 1;
+/*
+   Threshold rules, -x "COUNTER [rate|value] OP NUM[/s] [for N scans]
+   [on PATTERN[,PATTERN]]". Compiled once, evaluated each scan.
+*/
 
-	for (i=0; i<npatterns; i++) {
-		if (!fnmatch(patterns[i], id, 0))
-			return 1;
-	}
-	return 0;
-}
+enum { OP_GT, OP_GE, OP_LT, OP_LE, OP_EQ, OP_NE };
 
-static int get_netstat_nlmsg(struct sockaddr_nl *who, struct nlmsghdr *m, void *arg)
-{
-	struct ifinfomsg *ifi = NLMSG_DATA(m);
-	struct rtattr * tb[IFLA_MAX+1];
-	int len = m->nlmsg_len;
-	struct ifstat_ent *n;
-	uint64_t ival[MAXS];
-	int i;
+struct rule {
+	char *text;
+	int idx;
+	int use_rate;
+	int op;
+	double thresh;
+	int nscans;
+	struct group match;
+} rules[MAX_RULES];
+int nrules;
 
-	if (m->nlmsg_type != RTM_NEWLINK)
-		return 0;
+char *hook_cmd;
 
-	len -= NLMSG_LENGTH(sizeof(*ifi));
-	if (len < 0)
-		return -1;
+/* Event subscribers, kept open by the daemon */
+#define MAX_SUBS 16
+int subs[MAX_SUBS];
+int nsubs;
 
-	if (!(ifi->ifi_flags&IFF_UP))
-		return 0;
+int ewma;
+int overflow;
 
-	memset(tb, 0, sizeof(tb));
-	parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi), len);
-	if (tb[IFLA_IFNAME] == NULL || tb[IFLA_STATS64] == NULL)
-		return 0;
+/*
+   Daemon self-instrumentation. Stage durations are kept as
+   log2 histograms in usecs: bucket k counts samples < 2^k us.
+*/
 
-	n = malloc(sizeof(*n));
-	if (!n)
-		abort();
-	n->ifindex = ifi->ifi_index;
-	n->name = strdup(RTA_DATA(tb[IFLA_IFNAME]));
-	memcpy(&ival, RTA_DATA(tb[IFLA_STATS64]), sizeof(ival));
-	for (i=0; i<MAXS; i++) {
+#define HIST_BUCKETS 24
 
-#undef DO_L2_STATS
-#ifdef DO_L2_STATS
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bucket[HIST_BUCKETS];
+};
 
-		if(i == 2) n->ival[i] = n->ival[i]+4; /* RX CRC */
-		if(i == 3) n->ival[i] = n->ival[i]+18; /* TX 14+4 E-hdr + CRC */
-#endif
-		n->val[i] = ival[i];
-	}
-	n->next = kern_db;
-	kern_db = n;
-	return 0;
-}
+enum { ST_DUMP, ST_UPDATE, ST_SCAN, ST_SERVE, ST_MAX };
 
+static const char *stage_names[ST_MAX] = { "dump", "update", "scan", "serve" };
 
-static void load_info(void)
+struct {
+	struct hist stage[ST_MAX];
+	uint64_t scans;
+	uint64_t nl_recvs;	/* totals */
+	uint64_t nl_msgs;
+	uint64_t nl_bytes;
+	uint32_t scan_recvs;	/* last scan */
+	uint32_t scan_msgs;
+	uint64_t scan_bytes;
+	uint64_t targeted;	/* scans reading the watched set only */
+	uint64_t quiet_skips;	/* quiet interfaces left out of them */
+	uint64_t idle_scans;	/* at the IDLE_SCAN cadence */
+	uint64_t query_scans;	/* taken for a query, off schedule */
+	uint64_t speed_queries;	/* ethtool */
+	uint64_t if_added;
+	uint64_t if_removed;
+	uint64_t missed;
+	uint64_t queries;
+	uint64_t dropped;	/* clients closed, too many children */
+	uint64_t rejected;	/* peers of other uids */
+	uint64_t relayed;	/* tables queued to the aggregator */
+	uint64_t relay_skipped;	/* the last one still going out */
+	uint64_t relay_connects;
+	uint64_t tsub_skipped;	/* subscriber tables still going out */
+	uint64_t family_errors;	/* failed loads, retried next scan */
+} sstat;
+
+/* Client side copy of the daemon's stats records */
+struct stat_ent
 {
-	struct ifstat_ent *db, *n;
-	struct rtnl_handle rth;
+	struct stat_ent		*next;
+	char			*name;
+	char			*value;
+};
 
-	if (rtnl_open(&rth, 0) < 0)
-		exit(1);
+struct stat_ent *stat_db;
 
-	if (rtnl_wilddump_request(&rth, AF_INET, RTM_GETLINK) < 0) {
-		perror("Cannot send dump request");
-		exit(1);
-	}
+/* Per client request, parsed by read_client() before fork */
+#define MAX_QPAT 64
 
-	if (rtnl_dump_filter(&rth, get_netstat_nlmsg, NULL, NULL, NULL) < 0) {
-		fprintf(stderr, "Dump terminated\n");
-		exit(1);
-	}
+struct {
+	int stats;
+	int events;
+	int rollup;
+	int sort_key;
+	int topn;
+	char *patterns[MAX_QPAT];
+	int npatterns;
+	char profile[32];
+	uid_t uid;		/* peer */
+	char token[32];		/* baseline */
+	struct baseline *base;	/* the previous one, NULL on first use */
+	int scan_interval;	/* profile settings */
+	int time_constant;
+	unsigned families;	/* bit per families[] entry */
+	int links;		/* links too, with families */
+	struct user *user;	/* system daemon only */
+	int est;		/* estimator slot */
+	int fresh;		/* the last scan lacks what it asks for */
+	int binary;		/* struct ifstat2_if records, libifstat2 */
+	int subscribe;		/* a table after every scan */
+} query;
 
-	rtnl_close(&rth);
+/*
+   Table subscribers, libifstat2. The daemon queues each its table after
+   every scheduled scan, without a fork, and writes it out as the socket
+   takes it; while one is still going out the next is skipped.
+*/
+#define MAX_TSUBS 16
 
-	db = kern_db;
-	kern_db = NULL;
+struct tsub {
+	int fd;
+	struct matcher m;
+	int rollup;
+	int est;		/* slot, while it keeps its name */
+	char profile[32];
+	uid_t uid;
+	char *buf;		/* table going out */
+	size_t len, off;
+} tsubs[MAX_TSUBS];
+int ntsubs;
 
-	while (db) {
-		n = db;
-		db = db->next;
-		n->next = kern_db;
-		kern_db = n;
-	}
-}
+/*
+   Watched set. Patterns of recent client queries, and of rules and
+   groups, which never expire. When the set is small compared to the
+   table, only its interfaces are read each scan, with a full dump
+   every FULL_EVERY scans to pick up new links.
+*/
 
+#define MAX_WATCH 64
+#define WATCH_TTL 60
+#define FULL_EVERY 10
 
-/* 
-   Read data from unix socket 
+struct {
+	char *pattern[MAX_WATCH];
+	time_t last[MAX_WATCH];		/* 0 never expires */
+	int n;
+	int all;			/* a rule or group without patterns */
+	time_t full;			/* last query over all interfaces */
+	int changed;
+	int *idx;			/* watched ifindexes, kern_db order */
+	int nidx;
+	double full_us;			/* measured cost of a full dump */
+	double one_us;			/* measured cost of one targeted read */
+	int since_full;
+	struct matcher m;		/* of pattern */
+} watch;
+
+int scan_partial;
+
+/*
+   Adaptive cadence. With no query for IDLE_AFTER seconds, no
+   subscribers and no rules the daemon samples every IDLE_SCAN
+   seconds. Targeted scans read interfaces whose counters did not
+   move for QUIET_SCANS scans only every QUIET_EVERY scans, except
+   for a query. Rates stay exact as the EWMA weight follows each
+   entry's own interval.
 */
+#define IDLE_AFTER 60
+#define IDLE_SCAN 30
+#define QUIET_SCANS 5
+#define QUIET_EVERY 8
 
-static void load_raw_table(FILE *fp)
+int scan_query;		/* the scan serves a query, read all */
+
+static uint64_t now_us(void)
 {
-	char buf[4096];
-	struct ifstat_ent *db = NULL;
-	struct ifstat_ent *n;
+	struct timespec ts;
 
-	while (fgets(buf, sizeof(buf), fp) != NULL) {
-		char *p;
-		char *next;
-		int i;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
 
-		if (buf[0] == '#') {
-			buf[strlen(buf)-1] = 0;
-			strncpy(info_source, buf+1, sizeof(info_source)-1);
-			continue;
-		}
-		if ((n = malloc(sizeof(*n))) == NULL)
-			abort();
+static void hist_add(struct hist *h, uint64_t us)
+{
+	int k = 0;
+
+	while (k < HIST_BUCKETS-1 && (us >> k))
+		k++;
+	h->bucket[k]++;
+	h->count++;
+	h->sum += us;
+	if (us > h->max)
+		h->max = us;
+}
 
-		if (!(p = strchr(buf, ' ')))
-			abort();
-		*p++ = 0;
+static void matcher_set(struct matcher *m, char **globs, int n)
+{
+	int i;
 
-		if (sscanf(buf, "%d", &n->ifindex) != 1)
-			abort();
-		if (!(next = strchr(p, ' ')))
-			abort();
-		*next++ = 0;
+	if (m->n == n) {
+		for (i = 0; i < n; i++)
+			if (strcmp(m->pat[i].glob, globs[i]))
+				break;
+		if (i == n)
+			return;
+	}
+	for (i = 0; i < m->n; i++)
+		free(m->pat[i].glob);
+	if ((m->pat = realloc(m->pat, (n+1) * sizeof(*m->pat))) == NULL)
+		abort();
+	for (i = 0; i < n; i++) {
+		struct pat *p = &m->pat[i];
 
-		n->name = strdup(p);
-		p = next;
+		if ((p->glob = strdup(globs[i])) == NULL)
+			abort();
+		p->plen = strcspn(p->glob, "*?[\\");
+		if (!p->glob[p->plen])
+			p->kind = PAT_NAME;
+		else if (!strcmp(p->glob + p->plen, "*"))
+			p->kind = PAT_PREFIX;
+		else
+			p->kind = PAT_GLOB;
+	}
+	m->n = n;
+	m->gen = ++matcher_gen;
+}
 
-		for (i=0; i<MAXS; i++) {
-			unsigned rate;
-			if (!(next = strchr(p, ' ')))
-				abort();
-			*next++ = 0;
-			if (sscanf(p, "%llu", n->val+i) != 1)
-				abort();
+static int matcher_test(struct matcher *m, const char *name)
+{
+	struct pat *p;
 
-			p = next;
-			if (!(next = strchr(p, ' ')))
-				abort();
-			*next++ = 0;
-			if (sscanf(p, "%u", &rate) != 1)
-				abort();
-			n->rate[i] = rate;
-			p = next;
-		}
-		n->next = db;
-		db = n;
+	for (p = m->pat; p < m->pat + m->n; p++) {
+		if (strncmp(name, p->glob, p->plen))
+			continue;
+		if (p->kind == PAT_PREFIX ||
+		    (p->kind == PAT_NAME && !name[p->plen]) ||
+		    (p->kind == PAT_GLOB &&
+		     !fnmatch(p->glob + p->plen, name + p->plen, 0)))
+			return 1;
 	}
+	return 0;
+}
 
-	while (db) {
-		n = db;
-		db = db->next;
-		n->next = kern_db;
-		kern_db = n;
+static int matcher_cached(struct matcher *m, struct mcache *c,
+			  const char *name)
+{
+	if (c->gen != m->gen) {
+		c->bits = matcher_test(m, name);
+		c->gen = m->gen;
 	}
+	return c->bits;
 }
 
-/* 
-   Write data to socket 
-*/
-
-static void dump_raw_db(FILE *fp)
+static void set_patterns(char **p, int n)
 {
-	struct ifstat_ent *n;
-
-	fprintf(fp, "#ovrf=%d EWMA=%d client-pid=%u -- %s\n", 
-		overflow, ewma, getpid(), info_source);
+	patterns = p;
+	npatterns = n;
+	matcher_set(&pmatch, p, n);
+}
 
-	for (n=kern_db; n; n=n->next) {
-		int i;
+static int match(char *id)
+{
+	if (npatterns == 0)
+		return 1;
+	return matcher_test(&pmatch, id);
+}
 
-		fprintf(fp, "%d %s ", n->ifindex, n->name);
-		for (i=0; i<MAXS; i++) {
-			fprintf(fp, "%llu %u ", n->val[i], (unsigned)n->rate[i]);
-		}
-		fprintf(fp, "\n");
-	}
+/* Same for an interface, cached until it is renamed */
+static int match_ent(struct ifstat_ent *n)
+{
+	if (npatterns == 0)
+		return 1;
+	return matcher_cached(&pmatch, &n->pm, n->name);
 }
 
-static void format_rate(FILE *fp, struct ifstat_ent *n, int i)
+static int counter_index(const char *name)
 {
-	char temp[64];
-#if 0
-	if (n->val[i] > 1024*1024*1024)
-		fprintf(fp, "%7lluM ", n->val[i]/(1024*1024));
-	else if (n->val[i] > 1024*1024)
-		fprintf(fp, "%7lluK ", n->val[i]/1024);
-	else
-		fprintf(fp, "%8llu ", n->val[i]);
+	int i;
 
-#endif
-	if (n->rate[i] > 1024*1024) {
-		sprintf(temp, "%uM", (unsigned)(n->rate[i]/(1024*1024)));
-		fprintf(fp, "%-11s ", temp);
-	} else if (n->rate[i] > 1024) {
-		sprintf(temp, "%uK", (unsigned)(n->rate[i]/1024));
-		fprintf(fp, "%-11s ", temp);
-	} else
-		fprintf(fp, "%-11u ", (unsigned)n->rate[i]);
+	for (i=0; i<MAXS; i++)
+		if (!strcmp(name, counter_names[i]))
+			return i;
+	for (i=0; i<sizeof(counter_alias)/sizeof(counter_alias[0]); i++)
+		if (!strcmp(name, counter_alias[i].name))
+			return counter_alias[i].idx;
+	return -1;
 }
 
-static void print_head(FILE *fp)
-{
-	if(conf.noformat) {
-		return;
-	}
-	
-	if(conf.verbose) fprintf(fp, "#%s\n", info_source);
-	if(!conf.show_errors) {
-		fprintf(fp, "%42s", "RX --------------------------");	
-		fprintf(fp, "%-30s\n", "   TX --------------------------");
-		return;
-	}
+/*
+   Top-N selection over the numeric rates. Quickselect partitions the
+   k largest to the front, only those are sorted and kept in kern_db.
+*/
 
-	fprintf(fp, "%-10s ", "Interface");
+static int sort_key;
+
+static double ent_rate(const struct ifstat_ent *n, int key)
+{
+	return key < MAXS ? n->rate[key] : n->util[key - MAXS];
+}
 
-	fprintf(fp, "%12s", "RX Pkts" );
-	fprintf(fp, "%12s", "TX Pkts" );
-	fprintf(fp, "%12s", "RX Data" );
-	fprintf(fp, "%12s\n","TX Data" );
+static int rate_cmp(const void *a, const void *b)
+{
+	const struct ifstat_ent *x = *(struct ifstat_ent **)a;
+	const struct ifstat_ent *y = *(struct ifstat_ent **)b;
 
-	fprintf(fp, "%-10s ", "");
-	fprintf(fp, "%12s", "RX Errs");
-	fprintf(fp, "%12s", "RX Drop");
-	fprintf(fp, "%12s", "RX Over");
-	fprintf(fp, "%12s\n","RX Leng");
+	if (ent_rate(x, sort_key) > ent_rate(y, sort_key))
+		return -1;
+	if (ent_rate(x, sort_key) < ent_rate(y, sort_key))
+		return 1;
+	return x->ifindex - y->ifindex;
+}
 
-	fprintf(fp, "%-10s ", "");
-	fprintf(fp, "%12s", "RX Crc ");
-	fprintf(fp, "%12s", "RX Frm ");
-	fprintf(fp, "%12s", "RX Fifo");
-	fprintf(fp, "%12s\n","RX Miss");
-	
-	fprintf(fp, "%-10s ", "");
-	fprintf(fp, "%12s", "TX Errs");
-	fprintf(fp, "%12s", "TX Drop");
-	fprintf(fp, "%12s", "Colli  ");
-	fprintf(fp, "%12s\n","TX Carr");
+static void swap_ent(struct ifstat_ent **v, int a, int b)
+{
+	struct ifstat_ent *t = v[a];
 
-	fprintf(fp, "%-10s ", "");
-	fprintf(fp, "%12s", "TX Abrt");
-	fprintf(fp, "%12s", "TX Fifo");
-	fprintf(fp, "%12s", "TX Hbt ");
-	fprintf(fp, "%12s\n","TX Wind");
+	v[a] = v[b];
+	v[b] = t;
 }
 
-static void nformat_rate(FILE *fp, double x)
+static void select_top(struct ifstat_ent **v, int cnt, int k)
 {
-	char temp[64];
-	uint64_t i = x;
-	
-	if(conf.noformat) {
-		fprintf(fp, "%llu pps ", i);
-		return;
+	int lo = 0, hi = cnt - 1;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo)/2;
+		int i, store;
+
+		/* median of three as pivot, parked at hi */
+		if (rate_cmp(&v[mid], &v[lo]) < 0)
+			swap_ent(v, mid, lo);
+		if (rate_cmp(&v[hi], &v[lo]) < 0)
+			swap_ent(v, hi, lo);
+		if (rate_cmp(&v[mid], &v[hi]) < 0)
+			swap_ent(v, mid, hi);
+
+		for (store = lo, i = lo; i < hi; i++)
+			if (rate_cmp(&v[i], &v[hi]) < 0)
+				swap_ent(v, i, store++);
+		swap_ent(v, store, hi);
+
+		if (store == k)
+			return;
+		if (store < k)
+			lo = store + 1;
+		else
+			hi = store - 1;
 	}
-
-	if (i > 1500*1000)
-		sprintf(temp, "%5.3f M",
-			((double)(i/1000))/1000);
-	else if (i > 5*1000)
-		sprintf(temp, "%7llu k", i/(1000));
-	else
-		sprintf(temp, "%7llu  ", i);
-	
-	fprintf(fp, "%10s %s", temp, "pps ");
 }
 
-static void nformat_bits(FILE *fp, double d)
+static void sort_db(int key, int topn, int filter)
 {
-	char temp[64];
+	struct ifstat_ent **v, *n;
+	int cnt = 0, i;
 
-	if(conf.noformat) {
-		fprintf(fp, "%.0f bits/s ", d*8);
+	for (n=kern_db; n; n=n->next)
+		cnt++;
+	if (!cnt)
 		return;
-	}
+	if ((v = malloc(cnt * sizeof(*v))) == NULL)
+		abort();
 
-	/*
-	  IEC standard 1998
-	  kbit = 1000 bits
-	  Mbit = 10^6 bits
-	  Gbit = 10^9 bits
-	*/
+	cnt = 0;
+	for (n=kern_db; n; n=n->next)
+		if (!filter || match_ent(n))
+			v[cnt++] = n;
 
-        if (d >= 125*1000*1000) 
-		sprintf(temp, "%3.1f G", d/((1000/8)*1000*1000));
-        else if (d >= 125*1000) 
-		sprintf(temp, "%3.1f M", d/((1000/8)*1000));
-        else if (d >= 128) 
-		sprintf(temp, "%3.1f k", d/(1000/8));
-        else 
-		sprintf(temp, "%4.0f  ", d*8);
+	sort_key = key;
+	if (topn > 0 && topn < cnt) {
+		select_top(v, cnt, topn);
+		cnt = topn;
+	}
+	qsort(v, cnt, sizeof(*v), rate_cmp);
 
-	fprintf(fp, "%10s %s", temp, "bit/s ");
+	kern_db = NULL;
+	for (i=cnt-1; i>=0; i--) {
+		v[i]->next = kern_db;
+		kern_db = v[i];
+	}
+	free(v);
 }
 
-
-static void print_one_if(FILE *fp, struct ifstat_ent *n)
+static void hash_db(struct ifstat_ent *db)
 {
-	int i;
+	struct ifstat_ent *n;
 
-	if(!conf.show_errors) {
+	memset(idx_hash, 0, sizeof(idx_hash));
+	for (n = db; n; n = n->next) {
+		struct ifstat_ent **h = &idx_hash[n->ifindex & (IDX_HSIZE-1)];
 
-		if(conf.noformat)
-			fprintf(fp, "%s ", n->name);
-		else
-			fprintf(fp, "%-10s ", n->name);
-		nformat_bits(fp, n->rate[2]);
-		nformat_rate(fp, n->rate[0]);
-		nformat_bits(fp, n->rate[3]);
-		nformat_rate(fp, n->rate[1]);
-		
-		fprintf(fp, "%s", "\n");
-		
+		n->hnext = *h;
+		*h = n;
+	}
+}
+
+static struct ifstat_ent *idx_lookup(int ifindex)
+{
+	struct ifstat_ent *n;
+
+	for (n = idx_hash[ifindex & (IDX_HSIZE-1)]; n; n = n->hnext)
+		if (n->ifindex == ifindex)
+			return n;
+	return NULL;
+}
+
+static void free_ent(struct ifstat_ent *n)
+{
+	free(n->name);
+	free(n->erate);
+	free(n);
+}
+
+static void free_db(struct ifstat_ent *db)
+{
+	while (db) {
+		struct ifstat_ent *tmp = db;
+		db = db->next;
+		free_ent(tmp);
+	}
+}
+
+static int group_match(struct group *g, char *id)
+{
+	/* Set up once options are read */
+	if (g->m.n != g->npatterns)
+		matcher_set(&g->m, g->patterns, g->npatterns);
+	return matcher_test(&g->m, id);
+}
+
+static int add_group(char *arg)
+{
+	struct group *g;
+	char *p, *pat;
+
+	if (ngroups >= MAX_GROUPS || (p = strchr(arg, '=')) == NULL || p == arg)
+		return -1;
+	g = &groups[ngroups];
+	*p++ = 0;
+	g->name = arg;
+	for (pat = strtok(p, ","); pat; pat = strtok(NULL, ",")) {
+		g->patterns = realloc(g->patterns, (g->npatterns+1)*sizeof(char *));
+		if (!g->patterns)
+			abort();
+		g->patterns[g->npatterns++] = pat;
+	}
+	if (!g->npatterns)
+		return -1;
+	ngroups++;
+	return 0;
+}
+
+/*
+   Link speed and duplex from ethtool, GLINKSETTINGS with a GSET
+   fallback. Queried for new links and again only when the link
+   flags or carrier changes count move; the /proc/net/dev collector
+   has neither and re-queries every SPEED_REFRESH scans.
+*/
+
+#define SPEED_REFRESH 60
+
+static void speed_query(struct ifstat_ent *n)
+{
+	static int fd = -1;
+	struct {
+		struct ethtool_link_settings req;
+		__u32 maps[3 * SCHAR_MAX];
+	} ls;
+	struct ethtool_cmd ec;
+	struct ifreq ifr;
+	__u32 speed = 0;
+
+	n->flags |= IFE_SPEED;
+	n->speed = 0;
+	n->duplex = DUPLEX_UNKNOWN;
+	sstat.speed_queries++;
+	if (fd < 0 && (fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		return;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, n->name, IFNAMSIZ-1);
+
+	/* The first call returns the mask size to ask for */
+	memset(&ls, 0, sizeof(ls));
+	ls.req.cmd = ETHTOOL_GLINKSETTINGS;
+	ifr.ifr_data = (void *)&ls;
+	if (ioctl(fd, SIOCETHTOOL, &ifr) == 0 &&
+	    ls.req.link_mode_masks_nwords < 0) {
+		ls.req.cmd = ETHTOOL_GLINKSETTINGS;
+		ls.req.link_mode_masks_nwords = -ls.req.link_mode_masks_nwords;
+		if (ioctl(fd, SIOCETHTOOL, &ifr) < 0)
+			return;
+		speed = ls.req.speed;
+		n->duplex = ls.req.duplex;
+	} else {
+		memset(&ec, 0, sizeof(ec));
+		ec.cmd = ETHTOOL_GSET;
+		ifr.ifr_data = (void *)&ec;
+		if (ioctl(fd, SIOCETHTOOL, &ifr) < 0)
+			return;
+		speed = ethtool_cmd_speed(&ec);
+		n->duplex = ec.duplex;
+	}
+	if (speed != (__u32)SPEED_UNKNOWN && speed <= INT_MAX)
+		n->speed = speed;
+}
+
+/* Keep the cached speed of o unless the link has changed */
+static void speed_update(struct ifstat_ent *ns, struct ifstat_ent *o)
+{
+	if (o && (o->flags & IFE_SPEED) && ns->lflags == o->lflags &&
+	    ns->lchanges == o->lchanges &&
+	    (conf.backend != BK_PROCDEV || sstat.scans % SPEED_REFRESH)) {
+		ns->flags |= IFE_SPEED;
+		ns->speed = o->speed;
+		ns->duplex = o->duplex;
+		return;
+	}
+	speed_query(ns);
+}
+
+static int link_speed(struct ifstat_ent *n)
+{
+	return n->speed ? n->speed : conf.nominal;
+}
+
+static void set_util(struct ifstat_ent *n)
+{
+	double bits = link_speed(n) * 1e6;
+
+	n->flags &= ~IFE_SAT;
+	if (!bits) {
+		n->util[0] = n->util[1] = 0;
+		return;
+	}
+	n->util[0] = n->rate[2] * 8 * 100 / bits;
+	n->util[1] = n->rate[3] * 8 * 100 / bits;
+	if (n->util[0] >= SAT_PCT || n->util[1] >= SAT_PCT)
+		n->flags |= IFE_SAT;
+}
+
+/*
+   Find or add rollup KEY of KIND in the list being built, through
+   roll_hash on both; with a c: entry per container the list is as
+   long as the table.
+*/
+static struct ifstat_ent *roll_hash[IDX_HSIZE];
+
+#define ROLL_HASH(key, kind) (((key) * 31 + (kind)) & (IDX_HSIZE-1))
+
+static struct ifstat_ent *rollup_ent(struct ifstat_ent **db, int key,
+				      char kind, const char *name)
+{
+	struct ifstat_ent *r, **h = &roll_hash[ROLL_HASH(key, kind)];
+
+	for (r = *h; r; r = r->hnext)
+		if (r->ifindex == key && r->name[0] == kind)
+			return r;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		abort();
+	r->ifindex = key;
+	if ((r->name = malloc(strlen(name) + 3)) == NULL)
+		abort();
+	sprintf(r->name, "%c:%s", kind, name);
+	r->duplex = DUPLEX_UNKNOWN;
+	r->next = *db;
+	*db = r;
+	r->hnext = *h;
+	*h = r;
+	return r;
+}
+
+/* peer counts n as seen from the other end, rx and tx swapped */
+static void rollup_add(struct ifstat_ent *r, struct ifstat_ent *n, int peer)
+{
+	int i, j;
+
+	for (i = 0; i < MAXS; i++) {
+		int k = peer && i < 8 ? i ^ 1 : i;
+
+		r->val[k] += n->val[i];
+		r->rate[k] += n->rate[i];
+	}
+	if (nest > 1 && !r->erate) {
+		if ((r->erate = calloc((nest-1)*MAXS, sizeof(double))) == NULL)
+			abort();
+		r->nerate = nest-1;
+	}
+	for (j = 0; j < r->nerate; j++)
+		for (i = 0; i < MAXS; i++)
+			r->erate[j*MAXS + (peer && i < 8 ? i ^ 1 : i)] +=
+				j < n->nerate ? n->erate[j*MAXS + i] : n->rate[i];
+	r->speed += link_speed(n);
+	r->members++;
+}
+
+/*
+   Containers by the netns id, in our netns, of the other end of their
+   veths, sorted on it. Filled by ctr_update() when a veth has an id
+   not known and emptied when links come or go, ids are reused.
+*/
+struct ctr {
+	int nsid;
+	char id[64];		/* pod UID, container ID, netns name */
+};
+
+static struct ctr *ctrs;
+static int nctrs;
+
+/* Where nsid is or goes */
+static int ctr_pos(int nsid)
+{
+	int lo = 0, hi = nctrs;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (ctrs[mid].nsid < nsid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Also ids looked for and not found */
+static int ctr_known(int nsid)
+{
+	int i = ctr_pos(nsid);
+
+	return i < nctrs && ctrs[i].nsid == nsid;
+}
+
+static struct ctr *ctr_find(int nsid)
+{
+	int i = ctr_pos(nsid);
+
+	if (i < nctrs && ctrs[i].nsid == nsid && ctrs[i].id[0])
+		return &ctrs[i];
+	return NULL;
+}
+
+/*
+   Sum rates per master (bond, bridge), per lower device (vlan,
+   macvlan), per group and per container. Run once per scan so a query is a read of
+   roll_db. Group members stacked on another member are skipped,
+   their traffic is already counted below or above them.
+*/
+
+static void update_rollups(void)
+{
+	struct ifstat_ent *n, *m, *db = NULL;
+	struct ctr *c;
+	int g;
+
+	free_db(roll_db);
+	roll_db = NULL;
+	memset(roll_hash, 0, sizeof(roll_hash));
+
+	/* Groups never change, entries keep theirs until renamed */
+	for (n = kern_db; n; n = n->next) {
+		if (n->gm.gen)
+			continue;
+		n->groups = 0;
+		for (g = 0; g < ngroups; g++)
+			if (group_match(&groups[g], n->name))
+				n->groups |= 1 << g;
+		n->gm.gen = 1;
+	}
+
+	for (n = kern_db; n; n = n->next) {
+		unsigned stacked = 0;
+
+		if (n->master && (m = idx_lookup(n->master)) != NULL) {
+			rollup_add(rollup_ent(&db, m->ifindex, 'm', m->name), n, 0);
+			stacked |= m->groups;
+		}
+		/* veth pairs in one netns link to each other, not a parent */
+		if (n->link && (m = idx_lookup(n->link)) != NULL &&
+		    m->link != n->ifindex) {
+			struct ifstat_ent *r;
+
+			/* Upper devices share the parent's capacity */
+			r = rollup_ent(&db, m->ifindex, 'p', m->name);
+			rollup_add(r, n, 0);
+			r->speed = link_speed(m);
+			stacked |= m->groups;
+		}
+		for (g = 0; g < ngroups; g++)
+			if ((n->groups & ~stacked) & (1 << g))
+				rollup_add(rollup_ent(&db, -(g+1), 'g', groups[g].name), n, 0);
+
+		/* Host end of a veth, the container's traffic is its peer's */
+		if (n->peerns && (c = ctr_find(n->peerns - 1)) != NULL)
+			rollup_add(rollup_ent(&db, n->peerns - 1, 'c', c->id), n, 1);
+	}
+	for (n = db; n; n = n->next)
+		set_util(n);
+	roll_db = db;
+}
+
+static int add_rule(const char *arg)
+{
+	static const char *ops[] = { ">", ">=", "<", "<=", "==", "!=" };
+	struct rule *r;
+	char *buf, *tok, *end;
+	int i;
+
+	if (nrules >= MAX_RULES)
+		return -1;
+	r = &rules[nrules];
+	memset(r, 0, sizeof(*r));
+	r->text = strdup(arg);
+	r->use_rate = 1;
+	r->nscans = 1;
+	buf = strdup(arg);
+
+	if ((tok = strtok(buf, " ")) == NULL ||
+	    (r->idx = counter_index(tok)) < 0)
+		return -1;
+	if ((tok = strtok(NULL, " ")) == NULL)
+		return -1;
+	if (!strcmp(tok, "rate") || !strcmp(tok, "value")) {
+		r->use_rate = tok[0] == 'r' || r->idx >= MAXS;
+		tok = strtok(NULL, " ");
+	}
+	for (i = 0; tok && i < sizeof(ops)/sizeof(ops[0]); i++)
+		if (!strcmp(tok, ops[i]))
+			break;
+	if (!tok || i == sizeof(ops)/sizeof(ops[0]))
+		return -1;
+	r->op = i;
+	if ((tok = strtok(NULL, " ")) == NULL)
+		return -1;
+	r->thresh = strtod(tok, &end);
+	if (end == tok || (*end && strcmp(end, "/s")))
+		return -1;
+
+	while ((tok = strtok(NULL, " ")) != NULL) {
+		if (!strcmp(tok, "for")) {
+			if ((tok = strtok(NULL, " ")) == NULL ||
+			    (r->nscans = atoi(tok)) <= 0 || r->nscans > 255)
+				return -1;
+		} else if (!strcmp(tok, "scans") || !strcmp(tok, "scan")) {
+			continue;
+		} else if (!strcmp(tok, "on")) {
+			char *pat;
+
+			if ((tok = strtok(NULL, " ")) == NULL)
+				return -1;
+			while ((pat = strsep(&tok, ",")) != NULL) {
+				r->match.patterns = realloc(r->match.patterns,
+					(r->match.npatterns+1)*sizeof(char *));
+				if (!r->match.patterns)
+					abort();
+				r->match.patterns[r->match.npatterns++] = pat;
+			}
+		} else
+			return -1;
+	}
+	nrules++;
+	return 0;
+}
+
+static void rule_match(struct ifstat_ent *n)
+{
+	int r;
+
+	n->rules = 0;
+	for (r = 0; r < nrules; r++)
+		if (!rules[r].match.npatterns ||
+		    group_match(&rules[r].match, n->name))
+			n->rules |= 1 << r;
+}
+
+static int rule_test(struct rule *r, double v)
+{
+	switch (r->op) {
+	case OP_GT: return v > r->thresh;
+	case OP_GE: return v >= r->thresh;
+	case OP_LT: return v < r->thresh;
+	case OP_LE: return v <= r->thresh;
+	case OP_EQ: return v == r->thresh;
+	default:    return v != r->thresh;
+	}
+}
+
+/*
+   Run the hook detached, grandchild of the daemon, so it is not
+   counted or reaped as a client child.
+*/
+
+static void run_hook(const char *event, struct rule *r, struct ifstat_ent *n,
+		     double v)
+{
+	char tmp[64];
+	pid_t pid;
+
+	if ((pid = fork()) != 0) {
+		if (pid > 0)
+			waitpid(pid, NULL, 0);
+		return;
+	}
+	if (fork() == 0) {
+		setenv("IFSTAT_EVENT", event, 1);
+		setenv("IFSTAT_RULE", r->text, 1);
+		setenv("IFSTAT_IF", n->name, 1);
+		sprintf(tmp, "%.0f", v);
+		setenv("IFSTAT_VALUE", tmp, 1);
+		execl("/bin/sh", "sh", "-c", hook_cmd, (char *)NULL);
+	}
+	_exit(0);
+}
+
+static void send_event(const char *event, struct rule *r, struct ifstat_ent *n,
+		       double v)
+{
+	char buf[512];
+	int len, i;
+
+	len = snprintf(buf, sizeof(buf), "%s %s %.0f %s\n",
+		       event, n->name, v, r->text);
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+
+	for (i = 0; i < nsubs; i++)
+		if (send(subs[i], buf, len, MSG_DONTWAIT|MSG_NOSIGNAL) < 0 &&
+		    errno != EAGAIN) {
+			close(subs[i]);
+			subs[i--] = subs[--nsubs];
+		}
+	if (hook_cmd)
+		run_hook(event, r, n, v);
+}
+
+/*
+   Evaluate rules against the interfaces they match. A rule fires
+   when it has held for nscans consecutive scans and clears once.
+*/
+
+static void eval_rules(void)
+{
+	struct ifstat_ent *n;
+	int i;
+
+	for (n = kern_db; n; n = n->next) {
+		for (i = 0; i < nrules && (n->rules >> i); i++) {
+			struct rule *r = &rules[i];
+			double v;
+
+			if (!(n->rules & (1 << i)))
+				continue;
+			v = r->use_rate ? ent_rate(n, r->idx) : n->val[r->idx];
+			if (rule_test(r, v)) {
+				if (n->rcount[i] < r->nscans &&
+				    ++n->rcount[i] == r->nscans)
+					send_event("fire", r, n, v);
+			} else if (n->rcount[i]) {
+				if (n->rcount[i] == r->nscans)
+					send_event("clear", r, n, v);
+				n->rcount[i] = 0;
+			}
+		}
+	}
+}
+
+static struct rtnl_handle rth;
+static int rth_ok;
+
+static int get_netstat_nlmsg(struct sockaddr_nl *who, struct nlmsghdr *m, void *arg)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(m);
+	struct rtattr * tb[IFLA_MAX+1];
+	int len = m->nlmsg_len;
+	struct ifstat_ent *n;
+	uint64_t ival[MAXS];
+	int i;
+
+	if (m->nlmsg_type != RTM_NEWLINK)
+		return 0;
+
+	len -= NLMSG_LENGTH(sizeof(*ifi));
+	if (len < 0)
+		return -1;
+
+	if (!(ifi->ifi_flags&IFF_UP))
+		return 0;
+
+	memset(tb, 0, sizeof(tb));
+	parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi), len);
+	if (tb[IFLA_IFNAME] == NULL || tb[IFLA_STATS64] == NULL)
+		return 0;
+
+	n = calloc(1, sizeof(*n));
+	if (!n)
+		abort();
+	n->ifindex = ifi->ifi_index;
+	n->name = strdup(RTA_DATA(tb[IFLA_IFNAME]));
+	n->stamp = rth.stamp / 1000;	/* when the kernel filled the batch */
+	if (tb[IFLA_MASTER])
+		n->master = *(__u32*)RTA_DATA(tb[IFLA_MASTER]);
+	n->lflags = ifi->ifi_flags;
+	if (tb[IFLA_CARRIER_CHANGES])
+		n->lchanges = *(__u32*)RTA_DATA(tb[IFLA_CARRIER_CHANGES]);
+	if (tb[IFLA_LINK_NETNSID])
+		n->peerns = *(__s32*)RTA_DATA(tb[IFLA_LINK_NETNSID]) + 1;
+	if (tb[IFLA_LINK] && !tb[IFLA_LINK_NETNSID] &&
+	    *(__u32*)RTA_DATA(tb[IFLA_LINK]) != ifi->ifi_index)
+		n->link = *(__u32*)RTA_DATA(tb[IFLA_LINK]);
+	memcpy(&ival, RTA_DATA(tb[IFLA_STATS64]), sizeof(ival));
+	for (i=0; i<MAXS; i++) {
+
+#undef DO_L2_STATS
+#ifdef DO_L2_STATS
+
+		if(i == 2) n->ival[i] = n->ival[i]+4; /* RX CRC */
+		if(i == 3) n->ival[i] = n->ival[i]+18; /* TX 14+4 E-hdr + CRC */
+#endif
+		n->val[i] = ival[i];
+	}
+	n->next = kern_db;
+	kern_db = n;
+	return 0;
+}
+
+
+static void nl_account(__u32 recvs, __u32 msgs, __u64 bytes)
+{
+	sstat.scan_recvs = rth.recvs - recvs;
+	sstat.scan_msgs = rth.msgs - msgs;
+	sstat.scan_bytes = rth.bytes - bytes;
+	sstat.nl_recvs += sstat.scan_recvs;
+	sstat.nl_msgs += sstat.scan_msgs;
+	sstat.nl_bytes += sstat.scan_bytes;
+}
+
+/* The daemon keeps one rtnetlink socket open for all scans */
+static int nl_open(void)
+{
+	if (rth_ok)
+		return 0;
+	if (rtnl_open(&rth, 0) < 0) {
+		if (rth.fd >= 0)
+			rtnl_close(&rth);
+		return -1;
+	}
+	rth_ok = 1;
+	return 0;
+}
+
+static void nl_close(void)
+{
+	if (rth_ok)
+		rtnl_close(&rth);
+	rth_ok = 0;
+}
+
+static int load_netlink(void)
+{
+	__u32 recvs = rth.recvs, msgs = rth.msgs;
+	__u64 bytes = rth.bytes;
+
+	if (nl_open() < 0)
+		return -1;
+
+	if (rtnl_wilddump_request(&rth, AF_INET, RTM_GETLINK) < 0) {
+		perror("Cannot send dump request");
+		nl_close();
+		return -1;
+	}
+
+	if (rtnl_dump_filter(&rth, get_netstat_nlmsg, NULL, NULL, NULL) < 0) {
+		fprintf(stderr, "Dump terminated\n");
+		nl_close();
+		return -1;
+	}
+	nl_account(recvs, msgs, bytes);
+	return 0;
+}
+
+/* Quiet entries are read in turn, spread over the scans */
+static int quiet_skip(struct ifstat_ent *o)
+{
+	if (scan_query || !o || o->quiet < QUIET_SCANS ||
+	    (sstat.scans + o->ifindex) % QUIET_EVERY == 0)
+		return 0;
+	sstat.quiet_skips++;
+	return 1;
+}
+
+/* One RTM_GETLINK per watched ifindex */
+static int load_netlink_targeted(void)
+{
+	struct {
+		struct nlmsghdr	n;
+		struct ifinfomsg i;
+	} req;
+	char answer[8192];
+	__u32 recvs = rth.recvs, msgs = rth.msgs;
+	__u64 bytes = rth.bytes;
+	int i;
+
+	if (nl_open() < 0)
+		return -1;
+
+	for (i = 0; i < watch.nidx; i++) {
+		if (quiet_skip(idx_lookup(watch.idx[i])))
+			continue;
+		memset(&req, 0, sizeof(req));
+		req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+		req.n.nlmsg_flags = NLM_F_REQUEST;
+		req.n.nlmsg_type = RTM_GETLINK;
+		req.i.ifi_family = AF_UNSPEC;
+		req.i.ifi_index = watch.idx[i];
+
+		/* A link gone since the last full dump is left to the next */
+		if (rtnl_talk(&rth, &req.n, 0, 0, (struct nlmsghdr *)answer,
+			      NULL, NULL) < 0)
+			continue;
+		get_netstat_nlmsg(NULL, (struct nlmsghdr *)answer, NULL);
+	}
+	nl_account(recvs, msgs, bytes);
+	return 0;
+}
+
+/* Our id of the netns open as fd, -1 for none */
+static int ctr_nsid(int fd)
+{
+	struct {
+		struct nlmsghdr	n;
+		struct rtgenmsg	g;
+		char		buf[64];
+	} req;
+	char answer[1024];
+	struct nlmsghdr *m = (struct nlmsghdr *)answer;
+	struct rtattr *tb[NETNSA_MAX+1];
+	int len;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtgenmsg));
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.n.nlmsg_type = RTM_GETNSID;
+	req.g.rtgen_family = AF_UNSPEC;
+	addattr32(&req.n, sizeof(req), NETNSA_FD, fd);
+	if (rtnl_talk(&rth, &req.n, 0, 0, m, NULL, NULL) < 0 ||
+	    m->nlmsg_type != RTM_NEWNSID)
+		return -1;
+	len = m->nlmsg_len - NLMSG_LENGTH(sizeof(struct rtgenmsg));
+	if (len < 0)
+		return -1;
+	memset(tb, 0, sizeof(tb));
+	parse_rtattr(tb, NETNSA_MAX, (struct rtattr *)((char *)NLMSG_DATA(m) +
+		     NLMSG_ALIGN(sizeof(struct rtgenmsg))), len);
+	if (!tb[NETNSA_NSID])
+		return -1;
+	return *(__s32*)RTA_DATA(tb[NETNSA_NSID]);
+}
+
+/*
+   Container of a process from its cgroup: the pod UID under kubepods,
+   else a 64 hex digit container ID, short, else the last component.
+*/
+static void ctr_id(const char *pid, char *id, int size)
+{
+	char path[PATH_MAX], buf[1024], *cg = NULL, *p, *q;
+	FILE *fp;
+	int n;
+
+	id[0] = 0;
+	snprintf(path, sizeof(path), "/proc/%s/cgroup", pid);
+	if ((fp = fopen(path, "r")) == NULL)
+		return;
+	while (fgets(buf, sizeof(buf), fp)) {
+		/* The unified hierarchy, else the first */
+		if ((p = strchr(buf, ':')) == NULL || (p = strchr(p+1, ':')) == NULL)
+			continue;
+		p[strcspn(p, "\n")] = 0;
+		if (!cg || !strncmp(buf, "0::", 3)) {
+			free(cg);
+			cg = strdup(p+1);
+		}
+	}
+	fclose(fp);
+	if (!cg)
+		return;
+
+	for (p = cg; (p = strstr(p, "pod")) != NULL; p += 3)
+		if ((n = strspn(p+3, "0123456789abcdef-_")) >= 32) {
+			snprintf(id, size, "pod%.*s", n, p+3);
+			for (q = id; *q; q++)
+				if (*q == '_')
+					*q = '-';
+			goto out;
+		}
+	for (p = cg + strlen(cg); p > cg; p--)
+		if (strspn(p, "0123456789abcdef") >= 64) {
+			snprintf(id, size, "%.12s", p);
+			goto out;
+		}
+	if ((p = strrchr(cg, '/')) != NULL && p[1])
+		snprintf(id, size, "%s", p+1);
+out:
+	free(cg);
+}
+
+static void ctr_add(int nsid, const char *id)
+{
+	int i = ctr_pos(nsid);
+
+	if (i < nctrs && ctrs[i].nsid == nsid)
+		return;
+	if ((ctrs = realloc(ctrs, (nctrs+1) * sizeof(*ctrs))) == NULL)
+		abort();
+	memmove(ctrs + i + 1, ctrs + i, (nctrs - i) * sizeof(*ctrs));
+	ctrs[i].nsid = nsid;
+	snprintf(ctrs[i].id, sizeof(ctrs[i].id), "%s", id);
+	nctrs++;
+}
+
+/*
+   Map netns ids to containers when links have changed and a veth
+   peer is in one not known: a process of each netns found in /proc,
+   then the names in /run/netns for those without one. Ids that stay
+   unknown are not looked for again until the next link change.
+*/
+static void ctr_update(void)
+{
+	static uint64_t links = -1;
+	struct ifstat_ent *n;
+	struct dirent *d;
+	char path[300], link[64], self[64] = "", id[64];
+	char **seen = NULL;
+	int nseen = 0, i, fd, nsid, want = 0;
+	DIR *dir;
+
+	if (links != sstat.if_added + sstat.if_removed) {
+		links = sstat.if_added + sstat.if_removed;
+		free(ctrs);
+		ctrs = NULL;
+		nctrs = 0;
+	}
+	for (n = kern_db; n && !want; n = n->next)
+		want = n->peerns && !ctr_known(n->peerns - 1);
+	if (!want || nl_open() < 0)
+		return;
+
+	readlink("/proc/self/ns/net", self, sizeof(self)-1);
+	if ((dir = opendir("/proc")) != NULL) {
+		while ((d = readdir(dir)) != NULL) {
+			ssize_t len;
+
+			if (!isdigit(d->d_name[0]))
+				continue;
+			snprintf(path, sizeof(path), "/proc/%s/ns/net", d->d_name);
+			if ((len = readlink(path, link, sizeof(link)-1)) <= 0)
+				continue;
+			link[len] = 0;
+			for (i = 0; i < nseen; i++)
+				if (!strcmp(seen[i], link))
+					break;
+			if (i < nseen || !strcmp(link, self))
+				continue;
+			if ((seen = realloc(seen, (nseen+1) * sizeof(*seen))) == NULL ||
+			    (seen[nseen++] = strdup(link)) == NULL)
+				abort();
+			if ((fd = open(path, O_RDONLY)) < 0)
+				continue;
+			nsid = ctr_nsid(fd);
+			close(fd);
+			if (nsid < 0)
+				continue;
+			ctr_id(d->d_name, id, sizeof(id));
+			if (id[0])
+				ctr_add(nsid, id);
+		}
+		closedir(dir);
+	}
+	if ((dir = opendir("/run/netns")) != NULL) {
+		while ((d = readdir(dir)) != NULL) {
+			if (d->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "/run/netns/%s", d->d_name);
+			if ((fd = open(path, O_RDONLY)) < 0)
+				continue;
+			nsid = ctr_nsid(fd);
+			close(fd);
+			if (nsid >= 0 && !ctr_find(nsid))
+				ctr_add(nsid, d->d_name);
+		}
+		closedir(dir);
+	}
+	for (i = 0; i < nseen; i++)
+		free(seen[i]);
+	free(seen);
+
+	/* Not found, not looked for again */
+	for (n = kern_db; n; n = n->next)
+		if (n->peerns)
+			ctr_add(n->peerns - 1, "");
+}
+
+/*
+   sysfs counterpart for the /proc/net/dev collector. The statistics
+   files of watched interfaces stay open and are re-read with pread.
+*/
+
+struct sysfs_if {
+	struct sysfs_if *next;
+	int ifindex;
+	char *name;
+	int fd[MAXS];
+	int seen;
+};
+
+static struct sysfs_if *sysfs_list;
+
+static void sysfs_close(struct sysfs_if *s)
+{
+	int i;
+
+	for (i = 0; i < MAXS; i++)
+		if (s->fd[i] >= 0)
+			close(s->fd[i]);
+	free(s->name);
+	free(s);
+}
+
+static struct sysfs_if *sysfs_get(struct ifstat_ent *n)
+{
+	struct sysfs_if *s;
+	char path[128];
+	int i;
+
+	for (s = sysfs_list; s; s = s->next)
+		if (s->ifindex == n->ifindex && !strcmp(s->name, n->name))
+			return s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		abort();
+	s->ifindex = n->ifindex;
+	s->name = strdup(n->name);
+	for (i = 0; i < MAXS; i++) {
+		snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s",
+			 n->name, counter_names[i]);
+		s->fd[i] = open(path, O_RDONLY);
+	}
+	s->next = sysfs_list;
+	sysfs_list = s;
+	return s;
+}
+
+static int load_sysfs_targeted(void)
+{
+	static int scan;
+	struct sysfs_if **ps;
+	int i, k;
+
+	scan++;
+	for (i = 0; i < watch.nidx; i++) {
+		struct ifstat_ent *o, *n;
+		struct sysfs_if *s;
+
+		if ((o = idx_lookup(watch.idx[i])) == NULL)
+			continue;
+		s = sysfs_get(o);
+		s->seen = scan;
+		if (quiet_skip(o))
+			continue;
+
+		if ((n = calloc(1, sizeof(*n))) == NULL)
+			abort();
+		n->ifindex = o->ifindex;
+		n->name = strdup(o->name);
+		for (k = 0; k < MAXS; k++) {
+			char buf[32];
+			ssize_t len;
+
+			if (s->fd[k] < 0 ||
+			    (len = pread(s->fd[k], buf, sizeof(buf)-1, 0)) <= 0)
+				continue;
+			buf[len] = 0;
+			n->val[k] = strtoull(buf, NULL, 10);
+		}
+		n->stamp = now_us();
+		n->next = kern_db;
+		kern_db = n;
+	}
+
+	/* Close interfaces no longer watched */
+	for (ps = &sysfs_list; *ps; ) {
+		struct sysfs_if *s = *ps;
+
+		if (s->seen != scan) {
+			*ps = s->next;
+			sysfs_close(s);
+		} else
+			ps = &s->next;
+	}
+	return 0;
+}
+
+/*
+   /proc/net/dev collector, for when rtnetlink is filtered. The file
+   is read with one pread into a buffer kept between scans and
+   parsed in place. /proc/net/dev has no ifindex, names are mapped
+   through a cache so if_nametoindex() runs for new names only.
+*/
+
+#define NAME_HSIZE 4096
+
+struct name_ent {
+	struct name_ent *next;
+	int ifindex;
+	int seen;
+	char name[IFNAMSIZ];
+};
+
+static struct name_ent *name_hash[NAME_HSIZE];
+
+static unsigned name_hashfn(const char *s, int len)
+{
+	unsigned h = 2166136261u;
+
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h & (NAME_HSIZE-1);
+}
+
+static int name_ifindex(const char *name, int len, int scan)
+{
+	struct name_ent *e, **h = &name_hash[name_hashfn(name, len)];
+
+	for (e = *h; e; e = e->next)
+		if (!strncmp(e->name, name, len) && !e->name[len]) {
+			e->seen = scan;
+			return e->ifindex;
+		}
+	if (len >= IFNAMSIZ || (e = calloc(1, sizeof(*e))) == NULL)
+		return 0;
+	memcpy(e->name, name, len);
+	e->ifindex = if_nametoindex(e->name);
+	e->seen = scan;
+	e->next = *h;
+	*h = e;
+	return e->ifindex;
+}
+
+/* Drop names not seen this scan, the index may be reused */
+static void name_expire(int scan)
+{
+	int i;
+
+	for (i = 0; i < NAME_HSIZE; i++) {
+		struct name_ent **pe = &name_hash[i];
+
+		while (*pe) {
+			struct name_ent *e = *pe;
+
+			if (e->seen != scan) {
+				*pe = e->next;
+				free(e);
+			} else
+				pe = &e->next;
+		}
+	}
+}
+
+static char *parse_u64(char *p, char *end, uint64_t *v)
+{
+	uint64_t x = 0;
+
+	while (p < end && *p == ' ')
+		p++;
+	while (p < end && *p >= '0' && *p <= '9')
+		x = x*10 + (*p++ - '0');
+	*v = x;
+	return p;
+}
+
+static int load_procdev(void)
+{
+	/* /proc/net/dev columns mapped to struct ifstats64 */
+	static const int col[16] = {
+		2, 0, 4, 6, 14, 13, 21, 8,	/* rx: bytes packets errs drop fifo frame compressed multicast */
+		3, 1, 5, 7, 18, 9, 17, 22,	/* tx: bytes packets errs drop fifo colls carrier compressed */
+	};
+	static int fd = -1;
+	static char *buf;
+	static size_t size = 16384;
+	static int scan;
+	char *p, *end;
+	ssize_t len;
+
+	if (fd < 0 && (fd = open("/proc/net/dev", O_RDONLY)) < 0) {
+		perror("ifstat: /proc/net/dev");
+		return -1;
+	}
+	for (;;) {
+		if (!buf && (buf = malloc(size)) == NULL)
+			abort();
+		if ((len = pread(fd, buf, size, 0)) < 0) {
+			perror("ifstat: /proc/net/dev");
+			return -1;
+		}
+		if (len < size)
+			break;
+		free(buf);
+		buf = NULL;
+		size *= 2;
+	}
+	scan++;
+
+	p = buf;
+	end = buf + len;
+	while (p < end) {
+		struct ifstat_ent *n;
+		char *name, *colon, *eol;
+		int i;
+
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+		if ((colon = memchr(p, ':', eol - p)) == NULL) {
+			/* header lines */
+			p = eol + 1;
+			continue;
+		}
+		for (name = p; *name == ' '; name++)
+			;
+
+		if ((n = calloc(1, sizeof(*n))) == NULL)
+			abort();
+		n->ifindex = name_ifindex(name, colon - name, scan);
+		if ((n->name = strndup(name, colon - name)) == NULL)
+			abort();
+		p = colon + 1;
+		for (i = 0; i < 16; i++)
+			p = parse_u64(p, eol, &n->val[col[i]]);
+
+		n->next = kern_db;
+		kern_db = n;
+		p = eol + 1;
+	}
+	name_expire(scan);
+	return 0;
+}
+
+
+static void watch_add(char *pattern, time_t now)
+{
+	int i, old = 0;
+
+	for (i = 0; i < watch.n; i++) {
+		if (!strcmp(watch.pattern[i], pattern)) {
+			if (watch.last[i])
+				watch.last[i] = now;
+			return;
+		}
+		if (watch.last[i] && (!watch.last[old] ||
+				      watch.last[i] < watch.last[old]))
+			old = i;
+	}
+	if (watch.n < MAX_WATCH)
+		i = watch.n++;
+	else if (watch.last[old])
+		free(watch.pattern[i = old]);
+	else
+		return;
+	watch.pattern[i] = strdup(pattern);
+	watch.last[i] = now;
+	watch.changed = 1;
+}
+
+static void watch_expire(time_t now)
+{
+	int i;
+
+	for (i = watch.n-1; i >= 0; i--)
+		if (watch.last[i] && now - watch.last[i] > WATCH_TTL) {
+			free(watch.pattern[i]);
+			watch.n--;
+			watch.pattern[i] = watch.pattern[watch.n];
+			watch.last[i] = watch.last[watch.n];
+			watch.changed = 1;
+		}
+}
+
+/* Rules and groups are watched for good */
+static void watch_init(void)
+{
+	int r, i;
+
+	for (r = 0; r < nrules; r++) {
+		if (!rules[r].match.npatterns)
+			watch.all = 1;
+		for (i = 0; i < rules[r].match.npatterns; i++)
+			watch_add(rules[r].match.patterns[i], 0);
+	}
+	for (r = 0; r < ngroups; r++)
+		for (i = 0; i < groups[r].npatterns; i++)
+			watch_add(groups[r].patterns[i], 0);
+}
+
+/* kern_db is the previous scan here */
+static int want_targeted(void)
+{
+	struct ifstat_ent *n;
+	time_t now = time(NULL);
+	int cnt = 0;
+
+	watch_expire(now);
+	if (!kern_db || !watch.n || watch.all || now - watch.full < WATCH_TTL ||
+	    watch.since_full >= FULL_EVERY)
+		return 0;
+
+	if (watch.changed) {
+		watch.nidx = 0;
+		for (n = kern_db; n; n = n->next)
+			cnt++;
+		watch.idx = realloc(watch.idx, cnt * sizeof(int));
+		if (cnt && !watch.idx)
+			abort();
+		matcher_set(&watch.m, watch.pattern, watch.n);
+		for (n = kern_db; n; n = n->next)
+			if (matcher_cached(&watch.m, &n->wm, n->name))
+				watch.idx[watch.nidx++] = n->ifindex;
+		watch.changed = 0;
+	}
+	/* Unmeasured, try it once */
+	if (watch.one_us == 0)
+		return 1;
+	return watch.nidx * watch.one_us < watch.full_us;
+}
+
+/*
+   Collect a new table. kern_db, the previous one, is left as is;
+   collectors prepend to kern_db meanwhile so the result is reversed
+   back into kernel order.
+*/
+
+static struct ifstat_ent *load_info(void)
+{
+	struct ifstat_ent *prev = kern_db, *db, *n;
+	uint64_t t0 = now_us();
+
+	scan_partial = want_targeted();
+	kern_db = NULL;
+	if (scan_partial) {
+		hash_db(prev);
+		if (conf.backend == BK_NETLINK)
+			load_netlink_targeted();
+		else
+			load_sysfs_targeted();
+		if (watch.nidx) {
+			double us = (double)(now_us() - t0) / watch.nidx;
+			watch.one_us = watch.one_us ? (watch.one_us*3 + us)/4 : us;
+		}
+		watch.since_full++;
+		sstat.targeted++;
+	} else {
+		if (conf.backend == BK_NETLINK && load_netlink() < 0) {
+			free_db(kern_db);
+			kern_db = NULL;
+			fprintf(stderr, "ifstat: rtnetlink unavailable, using /proc/net/dev\n");
+			conf.backend = BK_PROCDEV;
+		}
+		if (conf.backend == BK_PROCDEV && load_procdev() < 0)
+			exit(1);
+
+		watch.full_us = watch.full_us ?
+			(watch.full_us*3 + (now_us() - t0))/4 : now_us() - t0;
+		watch.since_full = 0;
+		watch.changed = 1;
+	}
+
+	db = kern_db;
+	kern_db = prev;
+
+	prev = NULL;
+	while (db) {
+		n = db;
+		db = db->next;
+		if (!n->stamp)
+			n->stamp = t0;
+		n->next = prev;
+		prev = n;
+	}
+	return prev;
+}
+
+
+/*
+   Delta and EWMA of cnt counters, new values nv/nr against the
+   previous sample ov/or taken interval ms earlier.
+*/
+
+static void update_rates(uint64_t *nv, double *nr, uint64_t *ov, double *or,
+			 int cnt, double interval)
+{
+	double w = 1 - exp(-log(10)*interval/conf.time_constant);
+	int i;
+
+	for (i = 0; i < cnt; i++) { 
+		uint64_t diff;
+		double sample;
+		
+		/* Handle one overflow correctly */
+
+		if( nv[i] < ov[i] ) {
+			diff = (0xFFFFFFFF - ov[i]) + nv[i]; 
+			overflow++;
+		}
+		else 
+			diff = nv[i] - ov[i];
+
+		if(interval <= conf.min_interval) {
+			ewma = -11;
+			nr[i] = or[i];
+			continue;
+		}
+		
+		/* Calc rate, the weight is exact for any interval */
+		
+		sample = (double)(diff*1000)/interval;
+		nr[i] = or[i] + w*(sample-or[i]);
+		ewma = 1;
+	}
+}
+
+/*
+   Profile rates of ns from o. The weight is exact for the interval,
+   so any sampling rate gives the same time constant. Slots set up
+   after o was sampled start at o's default rate.
+*/
+static void update_est(struct ifstat_ent *ns, struct ifstat_ent *o,
+		       double interval)
+{
+	int i, j;
+
+	if (nest == 1)
+		return;
+	if ((ns->erate = calloc((nest-1)*MAXS, sizeof(double))) == NULL)
+		abort();
+	ns->nerate = nest-1;
+	ns->escan = sstat.scans;
+	for (j = 1; j < nest; j++) {
+		double *nr = ns->erate + (j-1)*MAXS, *or = o->rate, w;
+
+		if (!est[j].name[0])
+			continue;
+		if (j <= o->nerate && o->escan >= est[j].born)
+			or = o->erate + (j-1)*MAXS;
+		if (interval <= conf.min_interval) {
+			memcpy(nr, or, MAXS*sizeof(double));
+			continue;
+		}
+		w = 1 - exp(-log(10)*interval/est[j].time_constant);
+		for (i = 0; i < MAXS; i++) {
+			/* A counter that went back was reset, no rate */
+			uint64_t diff = ns->val[i] < o->val[i] ? 0 :
+				ns->val[i] - o->val[i];
+
+			nr[i] = or[i] + w*((double)(diff*1000)/interval - or[i]);
+		}
+	}
+}
+
+/* Serve slot j: its rates replace n->rate, in the forked child */
+static void est_apply(struct ifstat_ent *db, int j)
+{
+	struct ifstat_ent *n;
+
+	for (n = db; n; n = n->next)
+		if (j <= n->nerate) {
+			memcpy(n->rate, n->erate + (j-1)*MAXS,
+			       MAXS*sizeof(double));
+			set_util(n);
+		}
+}
+
+/*
+   Counter families other than links. Entries are kept in id order
+   and carry a variable number of counters.
+*/
+
+struct cnt_ent
+{
+	struct cnt_ent		*next;
+	char			*name;
+	int			id;
+	int			nval;
+	unsigned		gauge;		/* level columns, not counters */
+	uint64_t		stamp;
+	uint64_t		*val;
+	double			*rate;
+};
+
+struct family {
+	const char		*tag;		/* "@tag" records */
+	const char		**names;	/* counter names */
+	int			(*load)(struct family *);	/* 1 updated db in place */
+	int			demand;		/* only while queried */
+	time_t			last_query;
+	struct cnt_ent		*db;
+	struct cnt_ent		**tail;		/* load appends here */
+	int			wanted;		/* client side */
+};
+
+static struct cnt_ent *cnt_new(struct family *fam, int id, const char *name,
+			       int nval)
+{
+	struct cnt_ent *c;
+
+	c = calloc(1, sizeof(*c) + nval*(sizeof(uint64_t)+sizeof(double)));
+	if (!c)
+		abort();
+	c->id = id;
+	c->name = strdup(name);
+	c->nval = nval;
+	c->rate = (double *)(c + 1);
+	c->val = (uint64_t *)(c->rate + nval);
+	*fam->tail = c;
+	fam->tail = &c->next;
+	return c;
+}
+
+static int cnt_gauge(const struct cnt_ent *c, int i)
+{
+	return i < 32 && (c->gauge & (1u << i));
+}
+
+static void free_cnt(struct cnt_ent *c)
+{
+	while (c) {
+		struct cnt_ent *tmp = c;
+		c = c->next;
+		free(tmp->name);
+		free(tmp);
+	}
+}
+
+/*
+   /proc/net/softnet_stat, one line of hex counters per online CPU.
+   The column count depends on the kernel; from 13 columns on the
+   last one is the CPU number, before that lines are in CPU order.
+*/
+
+static const char *softnet_names[] = {
+	"processed", "dropped", "time_squeeze", "c3", "c4", "c5", "c6",
+	"c7", "cpu_collision", "received_rps", "flow_limit", "backlog",
+	"cpu", NULL
+};
+
+#define SOFTNET_COLS 13
+#define SOFTNET_GAUGES (1 << 11 | 1 << 12)	/* backlog, cpu */
+
+/* Whole file into *buf, grown until it fits */
+static ssize_t pread_all(int fd, char **buf, int *size)
+{
+	ssize_t len;
+
+	for (;;) {
+		if (*buf && (len = pread(fd, *buf, *size, 0)) < *size)
+			return len;
+		*size = *size ? *size*2 : 65536;
+		if ((*buf = realloc(*buf, *size)) == NULL)
+			abort();
+	}
+}
+
+static int load_softnet(struct family *fam)
+{
+	static int fd = -1, size;
+	static char *buf;
+	char *p, *end;
+	ssize_t len;
+	int line = 0;
+	uint64_t t0 = now_us();
+
+	if (fd < 0 && (fd = open("/proc/net/softnet_stat", O_RDONLY)) < 0)
+		return -1;
+	if ((len = pread_all(fd, &buf, &size)) <= 0)
+		return -1;
+
+	p = buf;
+	end = buf + len;
+	while (p < end) {
+		uint64_t v[SOFTNET_COLS];
+		struct cnt_ent *c;
+		char name[16];
+		int ncol = 0, i;
+
+		while (p < end && *p != '\n') {
+			uint64_t x = 0;
+
+			while (p < end && *p == ' ')
+				p++;
+			while (p < end && isxdigit(*p)) {
+				x = x*16 + (isdigit(*p) ? *p - '0' :
+					    (*p | 0x20) - 'a' + 10);
+				p++;
+			}
+			if (ncol < SOFTNET_COLS)
+				v[ncol++] = x;
+			while (p < end && *p == ' ')
+				p++;
+		}
+		p++;
+		if (!ncol)
+			continue;
+		if (ncol >= SOFTNET_COLS)
+			line = v[SOFTNET_COLS-1];
+		snprintf(name, sizeof(name), "cpu%d", line);
+		c = cnt_new(fam, line, name, ncol);
+		c->gauge = SOFTNET_GAUGES;
+		c->stamp = t0;
+		for (i = 0; i < ncol; i++)
+			c->val[i] = v[i];
+		line++;
+	}
+	return 0;
+}
+
+/*
+   /proc/interrupts, rows of NIC queues only. The kernel formats the
+   whole file on every read, so it is read in one go, but only the
+   rows mapped to an interface are parsed. Their offsets are cached
+   and checked against the IRQ number each scan; a mismatch or a new
+   CPU header remaps all rows, as does every IRQ_REMAP scans to pick
+   up new and renamed links.
+*/
+
+#define IRQ_REMAP 60
+
+struct irq_row {
+	int		irq;
+	int		off;
+	char		*name;		/* "ifname:queue" */
+};
+
+struct irq_key {
+	struct irq_key	*next;
+	const char	*ifname;
+	char		key[64];
+};
+
+static struct {
+	char		*buf;
+	int		size;
+	char		*head;		/* CPU header line */
+	int		hlen;
+	int		ncpu;
+	struct irq_row	*row;
+	int		nrow;
+	int		scans;
+} irqs;
+
+static void irq_key_add(struct irq_key **h, const char *key,
+			const char *ifname)
+{
+	struct irq_key *k;
+
+	if ((k = calloc(1, sizeof(*k))) == NULL)
+		abort();
+	strncpy(k->key, key, sizeof(k->key)-1);
+	k->ifname = ifname;
+	h += name_hashfn(k->key, strlen(k->key));
+	k->next = *h;
+	*h = k;
+}
+
+static const char *irq_key_find(struct irq_key **h, const char *s, int len)
+{
+	struct irq_key *k;
+
+	for (k = h[name_hashfn(s, len)]; k; k = k->next)
+		if (!strncmp(k->key, s, len) && !k->key[len])
+			return k->ifname;
+	return NULL;
+}
+
+/*
+   Action names are driver specific: eth0-TxRx-3, i40e-eth0-TxRx-3,
+   virtio4-rx. Any '-' separated run matching an interface or the
+   name of its device maps the row, the rest names the queue.
+*/
+static char *irq_map(struct irq_key **h, char *act, int len)
+{
+	const char *ifname;
+	char name[128];
+	int s, e;
+
+	for (s = 0; s < len; s++) {
+		if (s && act[s-1] != '-')
+			continue;
+		for (e = s + 1; e <= len; e++) {
+			if (e < len && act[e] != '-')
+				continue;
+			if ((ifname = irq_key_find(h, act + s, e - s)) == NULL)
+				continue;
+			if (e < len)
+				e++;
+			snprintf(name, sizeof(name), "%s:%.*s", ifname,
+				 len - e, act + e);
+			if (e == len)
+				strcat(name, "all");
+			return strdup(name);
+		}
+	}
+	return NULL;
+}
+
+static int irq_row_cmp(const void *a, const void *b)
+{
+	return ((struct irq_row *)a)->irq - ((struct irq_row *)b)->irq;
+}
+
+static void irq_remap(int len)
+{
+	struct irq_key **h, *k;
+	struct ifstat_ent *n;
+	char *p, *end = irqs.buf + len, *eol;
+	int i, max = 0;
+
+	for (i = 0; i < irqs.nrow; i++)
+		free(irqs.row[i].name);
+	irqs.nrow = 0;
+	irqs.scans = 0;
+
+	if ((eol = memchr(irqs.buf, '\n', len)) == NULL)
+		return;
+	irqs.hlen = eol + 1 - irqs.buf;
+	free(irqs.head);
+	if ((irqs.head = malloc(irqs.hlen)) == NULL)
+		abort();
+	memcpy(irqs.head, irqs.buf, irqs.hlen);
+	irqs.ncpu = 0;
+	for (p = irqs.buf; p + 3 <= eol; p++)
+		if (!memcmp(p, "CPU", 3))
+			irqs.ncpu++;
+
+	if ((h = calloc(NAME_HSIZE, sizeof(*h))) == NULL)
+		abort();
+	for (n = kern_db; n; n = n->next) {
+		char path[64+IFNAMSIZ], dev[256], *b;
+		ssize_t l;
+
+		irq_key_add(h, n->name, n->name);
+		snprintf(path, sizeof(path), "/sys/class/net/%s/device",
+			 n->name);
+		if ((l = readlink(path, dev, sizeof(dev)-1)) <= 0)
+			continue;
+		dev[l] = 0;
+		b = strrchr(dev, '/');
+		irq_key_add(h, b ? b + 1 : dev, n->name);
+	}
+
+	for (p = eol + 1; p < end; p = eol + 1) {
+		char *q, *act;
+		int irq = 0;
+
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+		for (q = p; q < eol && *q == ' '; q++)
+			;
+		if (q == eol || !isdigit(*q))
+			continue;	/* NMI, LOC, ... */
+		while (q < eol && isdigit(*q))
+			irq = irq*10 + (*q++ - '0');
+
+		/* The action is the last word */
+		for (q = eol; q > p && isspace(q[-1]); q--)
+			;
+		for (act = q; act > p && !isspace(act[-1]); act--)
+			;
+		if ((act = irq_map(h, act, q - act)) == NULL)
+			continue;
+		if (irqs.nrow == max) {
+			max = max ? max*2 : 64;
+			irqs.row = realloc(irqs.row, max * sizeof(*irqs.row));
+			if (!irqs.row)
+				abort();
+		}
+		irqs.row[irqs.nrow].irq = irq;
+		irqs.row[irqs.nrow].off = p - irqs.buf;
+		irqs.row[irqs.nrow++].name = act;
+	}
+	qsort(irqs.row, irqs.nrow, sizeof(*irqs.row), irq_row_cmp);
+
+	for (i = 0; i < NAME_HSIZE; i++)
+		while ((k = h[i]) != NULL) {
+			h[i] = k->next;
+			free(k);
+		}
+	free(h);
+}
+
+/* Cached rows still start with their IRQ number */
+static int irq_check(int len)
+{
+	int i;
+
+	if (!irqs.head || len < irqs.hlen ||
+	    memcmp(irqs.buf, irqs.head, irqs.hlen))
+		return -1;
+	for (i = 0; i < irqs.nrow; i++) {
+		char *p = irqs.buf + irqs.row[i].off;
+		char *end = irqs.buf + len;
+		int irq = 0;
+
+		while (p < end && *p == ' ')
+			p++;
+		while (p < end && isdigit(*p))
+			irq = irq*10 + (*p++ - '0');
+		if (p >= end || *p != ':' || irq != irqs.row[i].irq)
+			return -1;
+	}
+	return 0;
+}
+
+static int load_irq(struct family *fam)
+{
+	static int fd = -1;
+	ssize_t len;
+	uint64_t t0 = now_us();
+	int i, c;
+
+	if (fd < 0 && (fd = open("/proc/interrupts", O_RDONLY)) < 0)
+		return -1;
+	if ((len = pread_all(fd, &irqs.buf, &irqs.size)) <= 0)
+		return -1;
+
+	if (++irqs.scans >= IRQ_REMAP || irq_check(len))
+		irq_remap(len);
+
+	for (i = 0; i < irqs.nrow; i++) {
+		char *p = irqs.buf + irqs.row[i].off;
+		struct cnt_ent *e;
+
+		p = strchr(p, ':') + 1;
+		e = cnt_new(fam, irqs.row[i].irq, irqs.row[i].name, irqs.ncpu);
+		e->stamp = t0;
+		for (c = 0; c < irqs.ncpu; c++)
+			p = parse_u64(p, irqs.buf + len, &e->val[c]);
+	}
+	return 0;
+}
+
+/*
+   Qdisc and class statistics over the daemon's rtnetlink socket: one
+   RTM_GETQDISC dump per scan, plus an RTM_GETTCLASS dump for each
+   interface with a classful qdisc. Entries are keyed by ifindex and
+   named like tc, eth0:htb:1: for a qdisc and eth0:htb:1:10 for a
+   class; qdiscs without a handle are named by parent, eth0:fq:@1:3.
+*/
+
+static const char *qdisc_names[] = {
+	"bytes", "packets", "drops", "overlimits", "requeues",
+	"backlog", "qlen", NULL
+};
+
+#define QDISC_COLS 7
+#define QDISC_GAUGES (1 << 5 | 1 << 6)	/* backlog, qlen */
+
+static const char *qdisc_classful[] = {
+	"htb", "hfsc", "drr", "qfq", "cbq", "ets", "prio", NULL
+};
+
+static struct {
+	int		*idx;		/* ifindexes to dump classes of */
+	int		n, max;
+	uint64_t	stamp;
+} qd;
+
+static void tc_handle(char *p, int size, __u32 h)
+{
+	if (h == TC_H_ROOT)
+		snprintf(p, size, "root");
+	else if (TC_H_MIN(h))
+		snprintf(p, size, "%x:%x", TC_H_MAJ(h) >> 16, TC_H_MIN(h));
+	else
+		snprintf(p, size, "%x:", TC_H_MAJ(h) >> 16);
+}
+
+/* Stats structs grow, older kernels send shorter ones */
+static void rta_copy(void *p, int size, struct rtattr *rta)
+{
+	int len = RTA_PAYLOAD(rta);
+
+	memset(p, 0, size);
+	memcpy(p, RTA_DATA(rta), len < size ? len : size);
+}
+
+static int get_qdisc_nlmsg(struct sockaddr_nl *who, struct nlmsghdr *m,
+			   void *arg)
+{
+	struct family *fam = arg;
+	struct tcmsg *t = NLMSG_DATA(m);
+	int len = m->nlmsg_len - NLMSG_LENGTH(sizeof(*t));
+	struct rtattr *tb[TCA_MAX+1];
+	struct ifstat_ent *n;
+	struct cnt_ent *c;
+	uint64_t v[QDISC_COLS];
+	const char *kind;
+	char name[128], h[32];
+	int i;
+
+	if (m->nlmsg_type != RTM_NEWQDISC && m->nlmsg_type != RTM_NEWTCLASS)
+		return 0;
+	if (len < 0)
+		return -1;
+	memset(tb, 0, sizeof(tb));
+	parse_rtattr(tb, TCA_MAX, TCA_RTA(t), len);
+	if (!tb[TCA_KIND] || (n = idx_lookup(t->tcm_ifindex)) == NULL)
+		return 0;
+	kind = RTA_DATA(tb[TCA_KIND]);
+	if (!strcmp(kind, "noqueue"))
+		return 0;
+
+	memset(v, 0, sizeof(v));
+	if (tb[TCA_STATS2]) {
+		struct rtattr *st[TCA_STATS_MAX+1];
+		struct gnet_stats_basic b;
+		struct gnet_stats_queue q;
+
+		memset(st, 0, sizeof(st));
+		parse_rtattr(st, TCA_STATS_MAX, RTA_DATA(tb[TCA_STATS2]),
+			     RTA_PAYLOAD(tb[TCA_STATS2]));
+		if (st[TCA_STATS_BASIC]) {
+			rta_copy(&b, sizeof(b), st[TCA_STATS_BASIC]);
+			v[0] = b.bytes;
+			v[1] = b.packets;
+		}
+		if (st[TCA_STATS_PKT64] &&
+		    RTA_PAYLOAD(st[TCA_STATS_PKT64]) >= sizeof(__u64))
+			memcpy(&v[1], RTA_DATA(st[TCA_STATS_PKT64]), 8);
+		if (st[TCA_STATS_QUEUE]) {
+			rta_copy(&q, sizeof(q), st[TCA_STATS_QUEUE]);
+			v[2] = q.drops;
+			v[3] = q.overlimits;
+			v[4] = q.requeues;
+			v[5] = q.backlog;
+			v[6] = q.qlen;
+		}
+	} else if (tb[TCA_STATS]) {
+		struct tc_stats s;
+
+		rta_copy(&s, sizeof(s), tb[TCA_STATS]);
+		v[0] = s.bytes;
+		v[1] = s.packets;
+		v[2] = s.drops;
+		v[3] = s.overlimits;
+		v[5] = s.backlog;
+		v[6] = s.qlen;
+	}
+
+	if (t->tcm_handle || m->nlmsg_type == RTM_NEWTCLASS) {
+		tc_handle(h, sizeof(h), t->tcm_handle);
+		snprintf(name, sizeof(name), "%s:%s:%s", n->name, kind, h);
+	} else {
+		tc_handle(h, sizeof(h), t->tcm_parent);
+		snprintf(name, sizeof(name), "%s:%s:@%s", n->name, kind, h);
+	}
+	c = cnt_new(fam, t->tcm_ifindex, name, QDISC_COLS);
+	c->gauge = QDISC_GAUGES;
+	c->stamp = qd.stamp;
+	for (i = 0; i < QDISC_COLS; i++)
+		c->val[i] = v[i];
+
+	if (m->nlmsg_type == RTM_NEWTCLASS)
+		return 0;
+	for (i = 0; qdisc_classful[i]; i++)
+		if (!strcmp(kind, qdisc_classful[i]))
+			break;
+	if (!qdisc_classful[i] || (qd.n && qd.idx[qd.n-1] == t->tcm_ifindex))
+		return 0;
+	if (qd.n == qd.max) {
+		qd.max = qd.max ? qd.max*2 : 16;
+		if ((qd.idx = realloc(qd.idx, qd.max * sizeof(int))) == NULL)
+			abort();
+	}
+	qd.idx[qd.n++] = t->tcm_ifindex;
+	return 0;
+}
+
+static int load_qdisc(struct family *fam)
+{
+	struct tcmsg t;
+	__u32 recvs = rth.recvs, msgs = rth.msgs;
+	__u64 bytes = rth.bytes;
+	int i;
+
+	if (nl_open() < 0)
+		return -1;
+
+	memset(&t, 0, sizeof(t));
+	t.tcm_family = AF_UNSPEC;
+	qd.n = 0;
+	qd.stamp = now_us();
+	if (rtnl_dump_request(&rth, RTM_GETQDISC, &t, sizeof(t)) < 0 ||
+	    rtnl_dump_filter(&rth, get_qdisc_nlmsg, fam, NULL, NULL) < 0) {
+		nl_close();
+		return -1;
+	}
+	for (i = 0; i < qd.n; i++) {
+		t.tcm_ifindex = qd.idx[i];
+		if (rtnl_dump_request(&rth, RTM_GETTCLASS, &t, sizeof(t)) < 0 ||
+		    rtnl_dump_filter(&rth, get_qdisc_nlmsg, fam, NULL, NULL) < 0) {
+			nl_close();
+			return -1;
+		}
+	}
+
+	/* Counted with the links, without touching the per scan figures */
+	sstat.nl_recvs += rth.recvs - recvs;
+	sstat.nl_msgs += rth.msgs - msgs;
+	sstat.nl_bytes += rth.bytes - bytes;
+	return 0;
+}
+
+/*
+   /proc/net/snmp, snmp6 and netstat, one entry per counter, named
+   as by nstat: TcpRetransSegs, Ip6InReceives, TcpExtTCPTimeouts.
+   The names are indexed from the headers once; later scans only
+   parse numbers and rebuild the index when a row's column count
+   moves (IcmpMsg grows a column per ICMP type seen).
+*/
+
+struct snmp_file {
+	const char	*path;
+	int		pairs;		/* "Proto: names" + "Proto: values" */
+	int		fd;
+	char		*buf;
+	int		size;
+	char		**names;
+	char		*gauge;		/* per name */
+	int		n;
+	int		*cols;		/* values per row, pairs only */
+	int		nrows;
+	uint64_t	*v;
+};
+
+static struct snmp_file snmp_files[] = {
+	{ "/proc/net/snmp", 1 },
+	{ "/proc/net/snmp6", 0 },
+	{ "/proc/net/netstat", 1 },
+};
+
+/* Levels among the counters, nstat leaves the same ones out */
+static const char *snmp_gauges[] = {
+	"IpForwarding", "IpDefaultTTL", "TcpRtoAlgorithm", "TcpRtoMin",
+	"TcpRtoMax", "TcpMaxConn", "TcpCurrEstab", NULL
+};
+
+static void snmp_add_name(struct snmp_file *f, const char *pfx, int plen,
+			  const char *s, int len)
+{
+	char *name;
+	int i;
+
+	if ((f->n & 63) == 0 &&
+	    ((f->names = realloc(f->names, (f->n + 64) * sizeof(char *))) == NULL ||
+	     (f->gauge = realloc(f->gauge, f->n + 64)) == NULL))
+		abort();
+	if ((name = malloc(plen + len + 1)) == NULL)
+		abort();
+	memcpy(name, pfx, plen);
+	memcpy(name + plen, s, len);
+	name[plen + len] = 0;
+	for (i = 0; snmp_gauges[i]; i++)
+		if (!strcmp(name, snmp_gauges[i]))
+			break;
+	f->gauge[f->n] = snmp_gauges[i] != NULL;
+	f->names[f->n++] = name;
+}
+
+static void snmp_index(struct snmp_file *f, char *buf, int len)
+{
+	char *p = buf, *end = buf + len, *eol, *q;
+	int i, line = 0;
+
+	for (i = 0; i < f->n; i++)
+		free(f->names[i]);
+	f->n = 0;
+	f->nrows = 0;
+
+	for (; p < end; p = eol + 1, line++) {
+		int plen, cnt = 0;
+
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+		if (!f->pairs) {
+			for (q = p; q < eol && !isspace(*q); q++)
+				;
+			if (q > p)
+				snmp_add_name(f, "", 0, p, q - p);
+			continue;
+		}
+
+		/* Names on even rows, values on odd */
+		if ((line & 1) || (q = memchr(p, ':', eol - p)) == NULL)
+			continue;
+		plen = q - p;
+		for (q++; q < eol; ) {
+			char *w;
+
+			while (q < eol && *q == ' ')
+				q++;
+			for (w = q; q < eol && *q != ' '; q++)
+				;
+			if (q > w) {
+				snmp_add_name(f, p, plen, w, q - w);
+				cnt++;
+			}
+		}
+		if ((f->nrows & 15) == 0 &&
+		    (f->cols = realloc(f->cols, (f->nrows + 16) * sizeof(int))) == NULL)
+			abort();
+		f->cols[f->nrows++] = cnt;
+	}
+	if ((f->v = realloc(f->v, (f->n + 1) * sizeof(uint64_t))) == NULL)
+		abort();
+}
+
+static char *parse_s64(char *p, char *end, uint64_t *v)
+{
+	int neg;
+
+	while (p < end && isspace(*p))
+		p++;
+	if ((neg = p < end && *p == '-'))
+		p++;
+	p = parse_u64(p, end, v);
+	if (neg)
+		*v = -*v;
+	return p;
+}
+
+/* Values into f->v in index order, -1 when the layout has moved */
+static int snmp_scan(struct snmp_file *f, char *buf, int len)
+{
+	char *p = buf, *end = buf + len, *eol;
+	int line = 0, row = 0, k = 0;
+
+	for (; p < end; p = eol + 1, line++) {
+		int cnt = 0;
+
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+		if (!f->pairs) {
+			while (p < eol && !isspace(*p))
+				p++;
+			if (k >= f->n)
+				return -1;
+			parse_s64(p, eol, &f->v[k++]);
+			continue;
+		}
+		if (!(line & 1))
+			continue;
+		if (row >= f->nrows || (p = memchr(p, ':', eol - p)) == NULL)
+			return -1;
+		for (p++; p < eol; cnt++) {
+			if (k + cnt >= f->n)
+				return -1;
+			p = parse_s64(p, eol, &f->v[k + cnt]);
+			while (p < eol && *p == ' ')
+				p++;
+		}
+		if (cnt != f->cols[row++])
+			return -1;
+		k += cnt;
+	}
+	return k == f->n ? 0 : -1;
+}
+
+/*
+   The entries are made with the name table and after that only get
+   new values and rates, in place.
+*/
+static int load_snmp_file(struct family *fam, struct snmp_file *f)
+{
+	uint64_t t0 = now_us();
+	struct cnt_ent *c;
+	ssize_t len;
+	int i;
+
+	if (!f->names && (f->fd = open(f->path, O_RDONLY)) < 0)
+		return -1;
+	if ((len = pread_all(f->fd, &f->buf, &f->size)) <= 0)
+		return -1;
+	if (!f->names || snmp_scan(f, f->buf, len)) {
+		snmp_index(f, f->buf, len);
+		free_cnt(fam->db);
+		fam->db = NULL;
+		fam->tail = &fam->db;
+		for (i = 0; i < f->n; i++) {
+			c = cnt_new(fam, i, f->names[i], 1);
+			c->gauge = f->gauge[i];
+		}
+		if (snmp_scan(f, f->buf, len))
+			return -1;
+	}
+	for (c = fam->db, i = 0; c; c = c->next, i++) {
+		uint64_t ov = c->val[0];
+
+		c->val[0] = f->v[i];
+		if (c->stamp && !c->gauge)
+			update_rates(c->val, c->rate, &ov, c->rate, 1,
+				     (double)(t0 - c->stamp) / 1000);
+		c->stamp = t0;
+	}
+	return 1;
+}
+
+static int load_snmp(struct family *fam)
+{
+	return load_snmp_file(fam, &snmp_files[0]);
+}
+
+static int load_snmp6(struct family *fam)
+{
+	return load_snmp_file(fam, &snmp_files[1]);
+}
+
+static int load_netstat(struct family *fam)
+{
+	return load_snmp_file(fam, &snmp_files[2]);
+}
+
+static struct family families[] = {
+	{ "softnet", softnet_names, load_softnet },
+	{ "irq", NULL, load_irq, 1 },
+	{ "qdisc", qdisc_names, load_qdisc, 1 },
+	{ "snmp", NULL, load_snmp },
+	{ "snmp6", NULL, load_snmp6 },
+	{ "netstat", NULL, load_netstat },
+};
+
+#define NFAMILIES (sizeof(families)/sizeof(families[0]))
+
+static struct family *family_find(const char *tag)
+{
+	int f;
+
+	for (f = 0; f < NFAMILIES; f++)
+		if (!strcmp(families[f].tag, tag))
+			return &families[f];
+	return NULL;
+}
+
+/* Entries sort by id, then name: qdiscs share their ifindex */
+static int cnt_cmp(const void *a, const void *b)
+{
+	const struct cnt_ent *x = *(struct cnt_ent **)a;
+	const struct cnt_ent *y = *(struct cnt_ent **)b;
+
+	if (x->id != y->id)
+		return x->id < y->id ? -1 : 1;
+	return strcmp(x->name, y->name);
+}
+
+static struct cnt_ent *sort_cnt(struct cnt_ent *list)
+{
+	struct cnt_ent **v, *c, *prev = NULL;
+	int n = 0, i;
+
+	/* Most loaders already append in order */
+	for (c = list; c; prev = c, c = c->next)
+		if (prev && cnt_cmp(&prev, &c) > 0)
+			break;
+	if (!c)
+		return list;
+
+	for (c = list; c; c = c->next)
+		n++;
+	if ((v = malloc(n * sizeof(*v))) == NULL)
+		abort();
+	for (i = 0, c = list; c; c = c->next)
+		v[i++] = c;
+	qsort(v, n, sizeof(*v), cnt_cmp);
+	for (i = 0; i < n - 1; i++)
+		v[i]->next = v[i+1];
+	v[n-1]->next = NULL;
+	list = v[0];
+	free(v);
+	return list;
+}
+
+static void update_family(struct family *fam)
+{
+	struct cnt_ent *new = NULL, *o, *c;
+	int ret;
+
+	if (fam->demand && time(NULL) - fam->last_query > WATCH_TTL)
+		return;
+	fam->tail = &new;
+	if ((ret = fam->load(fam)) < 0) {
+		/* Keep the last sample, the next scan tries again */
+		free_cnt(new);
+		sstat.family_errors++;
+		return;
+	}
+	if (ret > 0)
+		return;
+	new = sort_cnt(new);
+
+	/* Both lists in cnt_cmp order */
+	o = fam->db;
+	for (c = new; c; c = c->next) {
+		int i;
+
+		while (o && cnt_cmp(&o, &c) < 0)
+			o = o->next;
+		if (!o || cnt_cmp(&o, &c) || o->nval != c->nval)
+			continue;
+		if (!c->gauge) {
+			update_rates(c->val, c->rate, o->val, o->rate, c->nval,
+				     (double)(c->stamp - o->stamp) / 1000);
+			continue;
+		}
+		/* Levels are reported as they are, rate stays 0 */
+		for (i = 0; i < c->nval; i++)
+			if (!cnt_gauge(c, i))
+				update_rates(&c->val[i], &c->rate[i],
+					     &o->val[i], &o->rate[i], 1,
+					     (double)(c->stamp - o->stamp) / 1000);
+	}
+	free_cnt(fam->db);
+	fam->db = new;
+}
+
+/* 
+   Read data from unix socket 
+*/
+
+static void load_raw_table(FILE *fp)
+{
+	char buf[4096];
+	struct ifstat_ent *db = NULL;
+	struct ifstat_ent *n;
+	struct stat_ent **stat_tail = &stat_db;
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		char *p;
+		char *next;
+		int i;
+
+		if (!strncmp(buf, "#baseline ", 10)) {
+			buf[strlen(buf)-1] = 0;
+			strncpy(base_info, buf+10, sizeof(base_info)-1);
+			continue;
+		}
+		if (buf[0] == '#') {
+			buf[strlen(buf)-1] = 0;
+			strncpy(info_source, buf+1, sizeof(info_source)-1);
+			continue;
+		}
+		if (!strncmp(buf, "@stat ", 6)) {
+			struct stat_ent *s;
+
+			buf[strlen(buf)-1] = 0;
+			if (!(p = strchr(buf+6, ' ')))
+				abort();
+			*p++ = 0;
+			if ((s = malloc(sizeof(*s))) == NULL)
+				abort();
+			s->name = strdup(buf+6);
+			s->value = strdup(p);
+			s->next = NULL;
+			*stat_tail = s;
+			stat_tail = &s->next;
+			continue;
+		}
+		if (buf[0] == '@') {
+			struct family *fam;
+			struct cnt_ent *c;
+			char *tok, *save;
+			int id, nval;
+
+			if ((tok = strtok_r(buf+1, " ", &save)) == NULL ||
+			    (fam = family_find(tok)) == NULL)
+				continue;
+			if (!fam->tail)
+				fam->tail = &fam->db;
+			if ((tok = strtok_r(NULL, " ", &save)) == NULL)
+				abort();
+			id = atoi(tok);
+			if ((p = strtok_r(NULL, " ", &save)) == NULL ||
+			    (tok = strtok_r(NULL, " ", &save)) == NULL)
+				abort();
+			nval = atoi(tok);
+			c = cnt_new(fam, id, p, nval);
+			for (i = 0; i < nval; i++) {
+				if ((tok = strtok_r(NULL, " ", &save)) == NULL)
+					abort();
+				c->val[i] = strtoull(tok, NULL, 10);
+				if ((tok = strtok_r(NULL, " \n", &save)) == NULL)
+					abort();
+				c->rate[i] = strtoul(tok, NULL, 10);
+			}
+			continue;
+		}
+		/* flags, matcher caches and profile rates start cleared */
+		if ((n = calloc(1, sizeof(*n))) == NULL)
+			abort();
+
+		if (!(p = strchr(buf, ' ')))
+			abort();
+		*p++ = 0;
+
+		if (sscanf(buf, "%d", &n->ifindex) != 1)
+			abort();
+		if (!(next = strchr(p, ' ')))
+			abort();
+		*next++ = 0;
+
+		n->name = strdup(p);
+		p = next;
+
+		for (i=0; i<MAXS; i++) {
+			unsigned rate;
+			if (!(next = strchr(p, ' ')))
+				abort();
+			*next++ = 0;
+			if (sscanf(p, "%" SCNu64, n->val+i) != 1)
+				abort();
+
+			p = next;
+			if (!(next = strchr(p, ' ')))
+				abort();
+			*next++ = 0;
+			if (sscanf(p, "%u", &rate) != 1)
+				abort();
+			n->rate[i] = rate;
+			p = next;
+		}
+		if (sscanf(p, "%d %d %lf %lf %d", &n->speed, &n->duplex,
+			   &n->util[0], &n->util[1], &i) == 5 && i)
+			n->flags |= IFE_SAT;
+		n->next = db;
+		db = n;
+	}
+
+	while (db) {
+		n = db;
+		db = db->next;
+		n->next = kern_db;
+		kern_db = n;
+	}
+}
+
+static long rss_kb(void)
+{
+	FILE *fp;
+	long size, rss = 0;
+
+	if ((fp = fopen("/proc/self/statm", "r")) == NULL)
+		return -1;
+	if (fscanf(fp, "%ld %ld", &size, &rss) != 2)
+		rss = 0;
+	fclose(fp);
+	return rss * (sysconf(_SC_PAGESIZE)/1024);
+}
+
+/*
+   Write daemon stats records, "@stat <name> <value>"
+*/
+
+static void dump_stats(FILE *fp)
+{
+	int s, k;
+
+	fprintf(fp, "@stat scans %" PRIu64 "\n", sstat.scans);
+	for (s=0; s<ST_MAX; s++) {
+		struct hist *h = &sstat.stage[s];
+		int top = HIST_BUCKETS;
+
+		fprintf(fp, "@stat %s_us_count %" PRIu64 "\n", stage_names[s], h->count);
+		fprintf(fp, "@stat %s_us_avg %" PRIu64 "\n", stage_names[s],
+			h->count ? h->sum/h->count : 0);
+		fprintf(fp, "@stat %s_us_max %" PRIu64 "\n", stage_names[s], h->max);
+
+		/* Trailing empty buckets are left out */
+		while (top > 1 && !h->bucket[top-1])
+			top--;
+		fprintf(fp, "@stat %s_us_hist", stage_names[s]);
+		for (k=0; k<top; k++)
+			fprintf(fp, " %" PRIu64, h->bucket[k]);
+		fprintf(fp, "\n");
+	}
+	fprintf(fp, "@stat nl_recvs_scan %u\n", sstat.scan_recvs);
+	fprintf(fp, "@stat nl_msgs_scan %u\n", sstat.scan_msgs);
+	fprintf(fp, "@stat nl_bytes_scan %" PRIu64 "\n", sstat.scan_bytes);
+	fprintf(fp, "@stat nl_recvs %" PRIu64 "\n", sstat.nl_recvs);
+	fprintf(fp, "@stat nl_msgs %" PRIu64 "\n", sstat.nl_msgs);
+	fprintf(fp, "@stat nl_bytes %" PRIu64 "\n", sstat.nl_bytes);
+	fprintf(fp, "@stat watched %d\n", watch.nidx);
+	fprintf(fp, "@stat full_dump_us %.0f\n", watch.full_us);
+	fprintf(fp, "@stat targeted_us %.0f\n", watch.one_us);
+	fprintf(fp, "@stat targeted_scans %" PRIu64 "\n", sstat.targeted);
+	fprintf(fp, "@stat quiet_skips %" PRIu64 "\n", sstat.quiet_skips);
+	fprintf(fp, "@stat idle_scans %" PRIu64 "\n", sstat.idle_scans);
+	fprintf(fp, "@stat query_scans %" PRIu64 "\n", sstat.query_scans);
+	fprintf(fp, "@stat speed_queries %" PRIu64 "\n", sstat.speed_queries);
+	fprintf(fp, "@stat if_added %" PRIu64 "\n", sstat.if_added);
+	fprintf(fp, "@stat if_removed %" PRIu64 "\n", sstat.if_removed);
+	fprintf(fp, "@stat missed_deadlines %" PRIu64 "\n", sstat.missed);
+	fprintf(fp, "@stat queries %" PRIu64 "\n", sstat.queries);
+	fprintf(fp, "@stat queries_dropped %" PRIu64 "\n", sstat.dropped);
+	fprintf(fp, "@stat queries_rejected %" PRIu64 "\n", sstat.rejected);
+	fprintf(fp, "@stat users %d\n", nusers);
+	fprintf(fp, "@stat relayed %" PRIu64 "\n", sstat.relayed);
+	fprintf(fp, "@stat relay_skipped %" PRIu64 "\n", sstat.relay_skipped);
+	fprintf(fp, "@stat relay_connects %" PRIu64 "\n", sstat.relay_connects);
+	fprintf(fp, "@stat tsub_skipped %" PRIu64 "\n", sstat.tsub_skipped);
+	fprintf(fp, "@stat family_errors %" PRIu64 "\n", sstat.family_errors);
+	for (k = 1; k < nest; k++)
+		if (est[k].name[0])
+			fprintf(fp, "@stat profile_%s uid=%d tc=%dms interval=%dms refs=%d\n",
+				est[k].name, (int)est[k].uid,
+				est[k].time_constant, est[k].scan_interval,
+				est[k].refs);
+	fprintf(fp, "@stat scan_ms %d\n", scan_ms);
+	fprintf(fp, "@stat overflows %d\n", overflow);
+	fprintf(fp, "@stat rss_kb %ld\n", rss_kb());
+}
+
+static void print_stats(FILE *fp)
+{
+	struct stat_ent *s;
+
+	for (s=stat_db; s; s=s->next)
+		fprintf(fp, "%-20s %s\n", s->name, s->value);
+}
+
+/* "@tag id name nval val rate ..." */
+static void dump_families(FILE *fp)
+{
+	struct cnt_ent *c;
+	int f, i;
+
+	for (f = 0; f < NFAMILIES; f++) {
+		if (!(query.families & (1 << f)))
+			continue;
+		for (c = families[f].db; c; c = c->next) {
+			/* "eth0:rx-3" matches as eth0 */
+			char *sub = strchr(c->name, ':');
+			int ok;
+
+			if (sub)
+				*sub = 0;
+			ok = match(c->name);
+			if (sub)
+				*sub = ':';
+			if (!ok)
+				continue;
+			fprintf(fp, "@%s %d %s %d", families[f].tag, c->id,
+				c->name, c->nval);
+			for (i = 0; i < c->nval; i++)
+				fprintf(fp, " %" PRIu64 " %u", c->val[i], (unsigned)c->rate[i]);
+			fprintf(fp, "\n");
+		}
+	}
+}
+
+/*
+   Baselines, -B TOKEN. The counters of the interfaces a query asked
+   for are kept per uid and token, and the next query with the token
+   gets exact deltas and average rates since. Entries are varints,
+   ifindex stamp val[MAXS], mostly a byte or two per counter. The
+   table is bounded and so is each uid's share of it; when either is
+   full the least recently used of the uid holding most goes first.
+*/
+#define MAX_BASE 64
+#define MAX_BASE_UID 16
+
+struct baseline {
+	uid_t		uid;
+	char		token[32];
+	uint64_t	created;	/* us */
+	int		n;
+	size_t		len;
+	unsigned char	*buf;
+};
+
+static struct baseline *bases[MAX_BASE];
+static int nbases;
+
+struct base_ent {
+	int		ifindex;
+	uint64_t	stamp;
+	uint64_t	val[MAXS];
+};
+
+static unsigned char *put_varint(unsigned char *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static unsigned char *get_varint(unsigned char *p, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	do {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	return p;
+}
+
+static void base_free(struct baseline *b)
+{
+	if (b) {
+		free(b->buf);
+		free(b);
+	}
+}
+
+/* Current counters of the interfaces matching the query's patterns */
+static struct baseline *base_make(uid_t uid, const char *token)
+{
+	struct baseline *b;
+	struct ifstat_ent *n;
+	unsigned char *p;
+	int cnt = 0, i;
+
+	for (n = kern_db; n; n = n->next)
+		cnt++;
+	if ((b = calloc(1, sizeof(*b))) == NULL ||
+	    (b->buf = malloc(cnt * (MAXS+2) * 10 + 1)) == NULL)
+		abort();
+	b->uid = uid;
+	strncpy(b->token, token, sizeof(b->token)-1);
+	b->created = now_us();
+
+	p = b->buf;
+	for (n = kern_db; n; n = n->next) {
+		if (!match_ent(n))
+			continue;
+		p = put_varint(p, n->ifindex);
+		p = put_varint(p, n->stamp);
+		for (i = 0; i < MAXS; i++)
+			p = put_varint(p, n->val[i]);
+		b->n++;
+	}
+	b->len = p - b->buf;
+	if ((b->buf = realloc(b->buf, b->len + 1)) == NULL)
+		abort();
+	return b;
+}
+
+static int base_count(uid_t uid)
+{
+	int i, cnt = 0;
+
+	for (i = 0; i < nbases; i++)
+		cnt += bases[i]->uid == uid;
+	return cnt;
+}
+
+/* Slot to reuse for a new baseline of uid, -1 while there is room */
+static int base_victim(uid_t uid)
+{
+	int i, cnt, most = 0, v = -1;
+
+	if (base_count(uid) >= MAX_BASE_UID) {
+		for (i = 0; bases[i]->uid != uid; i++)
+			;
+		return i;
+	}
+	if (nbases < MAX_BASE)
+		return -1;
+	/* Oldest first, so the first of the largest share is its LRU */
+	for (i = 0; i < nbases; i++)
+		if ((cnt = base_count(bases[i]->uid)) > most) {
+			most = cnt;
+			v = i;
+		}
+	return v;
+}
+
+/*
+   Replace the baseline of uid/token with the current counters and
+   return the old one, NULL the first time. Parent side, after the
+   scan and before the fork that serves the query.
+*/
+static struct baseline *base_swap(uid_t uid, const char *token)
+{
+	struct baseline *old = NULL, *b;
+	char **save = patterns;
+	int nsave = npatterns, i;
+
+	for (i = 0; i < nbases; i++)
+		if (bases[i]->uid == uid && !strcmp(bases[i]->token, token))
+			break;
+	if (i < nbases)
+		old = bases[i];
+	else if ((i = base_victim(uid)) >= 0)
+		base_free(bases[i]);
+	else
+		i = nbases++;
+
+	/* Most recently used last */
+	memmove(&bases[i], &bases[i+1], (nbases-1-i) * sizeof(*bases));
+
+	set_patterns(query.patterns, query.npatterns);
+	b = base_make(uid, token);
+	set_patterns(save, nsave);
+
+	bases[nbases-1] = b;
+	return old;
+}
+
+/* The query was not served, put the old baseline back */
+static void base_undo(struct baseline *old)
+{
+	base_free(bases[nbases-1]);
+	if (old)
+		bases[nbases-1] = old;
+	else
+		nbases--;
+}
+
+static int base_ent_cmp(const void *a, const void *b)
+{
+	return ((struct base_ent *)a)->ifindex - ((struct base_ent *)b)->ifindex;
+}
+
+/* Decoded and sorted by ifindex, for the forked child */
+static struct base_ent *base_load(struct baseline *b)
+{
+	struct base_ent *v;
+	unsigned char *p = b->buf;
+	uint64_t x;
+	int i, k;
+
+	if ((v = calloc(b->n + 1, sizeof(*v))) == NULL)
+		abort();
+	for (i = 0; i < b->n; i++) {
+		p = get_varint(p, &x);
+		v[i].ifindex = x;
+		p = get_varint(p, &v[i].stamp);
+		for (k = 0; k < MAXS; k++)
+			p = get_varint(p, &v[i].val[k]);
+	}
+	qsort(v, b->n, sizeof(*v), base_ent_cmp);
+	return v;
+}
+
+/*
+   Counters since the baseline replace val, their average rate since
+   replaces rate. A counter that went back was reset, it counts from
+   zero. Links new since the baseline show zero until the next one.
+*/
+static void base_apply(struct ifstat_ent *db, struct baseline *b)
+{
+	struct base_ent *v = NULL, key, *o;
+	struct ifstat_ent *n;
+	int i;
+
+	if (b)
+		v = base_load(b);
+	for (n = db; n; n = n->next) {
+		double secs;
+
+		key.ifindex = n->ifindex;
+		o = v ? bsearch(&key, v, b->n, sizeof(*v), base_ent_cmp) : NULL;
+		secs = o ? (double)(n->stamp - o->stamp) / 1000000 : 0;
+		for (i = 0; i < MAXS; i++) {
+			uint64_t d = 0;
+
+			if (o)
+				d = n->val[i] >= o->val[i] ?
+					n->val[i] - o->val[i] : n->val[i];
+			n->val[i] = d;
+			n->rate[i] = secs > 0 ? d / secs : 0;
+		}
+		set_util(n);
+	}
+	free(v);
+}
+
+/* 
+   Write data to socket 
+*/
+
+/*
+   A table as libifstat2 reads it, entries of db that m matches, or
+   that match_ent() does without m. Rates of slot est from the parent,
+   the child has applied its own.
+*/
+static void *bin_table(struct ifstat_ent *db, struct matcher *m, int est,
+		       size_t *len)
+{
+	struct ifstat2_hdr *h;
+	struct ifstat2_if *r;
+	struct ifstat_ent *n;
+	int cnt = 0, i;
+
+	for (n = db; n; n = n->next)
+		cnt++;
+	if ((h = calloc(1, sizeof(*h) + cnt * sizeof(*r))) == NULL)
+		abort();
+	h->magic = IFSTAT2_MAGIC;
+	h->recsize = sizeof(*r);
+	h->interval = scan_ms;
+	r = (struct ifstat2_if *)(h + 1);
+	for (n = db; n; n = n->next) {
+		if (m ? m->n && !matcher_test(m, n->name) : !match_ent(n))
+			continue;
+		r->ifindex = n->ifindex;
+		r->flags = n->flags & IFE_SAT ? IFSTAT2_SAT : 0;
+		strncpy(r->name, n->name, sizeof(r->name)-1);
+		r->speed = link_speed(n);
+		r->duplex = n->duplex;
+		r->util[0] = n->util[0];
+		r->util[1] = n->util[1];
+		for (i = 0; i < MAXS && i < IFSTAT2_NCOUNTERS; i++) {
+			r->val[i] = n->val[i];
+			r->rate[i] = est && est <= n->nerate ?
+				n->erate[(est-1)*MAXS + i] : n->rate[i];
+		}
+		r++;
+		h->count++;
+	}
+	*len = (char *)r - (char *)h;
+	return h;
+}
+
+/* The daemon's stats after the records of table h, as -S has them */
+static void *bin_stats(struct ifstat2_hdr *h, size_t *len)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *fp;
+
+	if ((fp = open_memstream(&buf, &size)) == NULL)
+		abort();
+	dump_stats(fp);
+	fclose(fp);
+	if ((h = realloc(h, *len + size)) == NULL)
+		abort();
+	memcpy((char *)h + *len, buf, size);
+	h->stats_len = size;
+	*len += size;
+	free(buf);
+	return h;
+}
+
+static void tsub_drop(int i)
+{
+	int j;
+
+	close(tsubs[i].fd);
+	for (j = 0; j < tsubs[i].m.n; j++)
+		free(tsubs[i].m.pat[j].glob);
+	free(tsubs[i].m.pat);
+	free(tsubs[i].buf);
+	tsubs[i] = tsubs[--ntsubs];
+	memset(&tsubs[ntsubs], 0, sizeof(*tsubs));
+}
+
+/* What the socket takes of subscriber i's table, -1 when dropped */
+static int tsub_flush(int i)
+{
+	struct tsub *t = &tsubs[i];
+	ssize_t n;
+
+	while (t->off < t->len) {
+		n = send(t->fd, t->buf + t->off, t->len - t->off,
+			 MSG_DONTWAIT|MSG_NOSIGNAL);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return 0;
+		if (n < 0) {
+			tsub_drop(i);
+			return -1;
+		}
+		t->off += n;
+	}
+	return 0;
+}
+
+/* A table to subscriber i, unless the last one is still going out */
+static int tsub_send(int i)
+{
+	struct tsub *t = &tsubs[i];
+
+	if (t->off < t->len) {
+		if (tsub_flush(i))
+			return -1;
+		if (t->off < t->len) {
+			sstat.tsub_skipped++;
+			return 0;
+		}
+	}
+	if (t->est && (strcmp(est[t->est].name, t->profile) ||
+		       est[t->est].uid != t->uid))
+		t->est = 0;
+	if (t->est)
+		est[t->est].last = time(NULL);
+	free(t->buf);
+	t->buf = bin_table(t->rollup ? roll_db : kern_db, &t->m, t->est,
+			   &t->len);
+	t->off = 0;
+	return tsub_flush(i);
+}
+
+/* Subscribers keep their interfaces in the watched set */
+static void tsub_watch(void)
+{
+	int i, j;
+
+	for (i = 0; i < ntsubs; i++) {
+		if (tsubs[i].rollup || !tsubs[i].m.n)
+			watch.full = time(NULL);
+		for (j = 0; j < tsubs[i].m.n; j++)
+			watch_add(tsubs[i].m.pat[j].glob, time(NULL));
+	}
+}
+
+/*
+   [ADDR:]PORT, ADDR numeric, [v6]; loopback without one. No names,
+   the resolver does not work in a static binary.
+*/
+static int tcp_addr(const char *spec, struct sockaddr_storage *ss,
+		    socklen_t *len)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+	char buf[256], *host = "127.0.0.1", *port, *end;
+	unsigned long pn;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	if ((port = strrchr(buf, ':')) != NULL) {
+		*port++ = 0;
+		if (buf[0] == '[') {
+			host = buf + 1;
+			host[strcspn(host, "]")] = 0;
+		} else if (buf[0])
+			host = buf;
+	} else
+		port = buf;
+	pn = strtoul(port, &end, 10);
+	if (end == port || *end || !pn || pn > 65535)
+		return -1;
+
+	memset(ss, 0, sizeof(*ss));
+	if (inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(pn);
+		*len = sizeof(*sin);
+	} else if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(pn);
+		*len = sizeof(*sin6);
+	} else
+		return -1;
+	return 0;
+}
+
+/* -K FILE, its first line; relays send it, the aggregator checks it */
+static void read_key(const char *path)
+{
+	static char key[65];
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL || !fgets(key, sizeof(key), fp)) {
+		fprintf(stderr, "ifstat: cannot read key from %s\n", path);
+		exit(1);
+	}
+	fclose(fp);
+	key[strcspn(key, "\r\n")] = 0;
+	if (!key[0] || strchr(key, ' ')) {
+		fprintf(stderr, "ifstat: bad key in %s\n", path);
+		exit(1);
+	}
+	conf.key = key;
+}
+
+/*
+   Relay, -U ADDR:PORT[,NAME]. After every scheduled scan the daemon
+   queues its table, as libifstat2 reads it, to the aggregator, after a
+   "relay NAME [KEY]" line on each new connection, NAME the hostname
+   unless given. The socket is not
+   blocking: while a table is still going out the next one is skipped,
+   and a lost aggregator is tried again every RELAY_RETRY seconds.
+*/
+#define RELAY_RETRY 10
+
+struct {
+	int fd;
+	struct sockaddr_storage addr;
+	socklen_t alen;
+	char *buf;
+	size_t len, off;
+	time_t tried;
+} relay = { -1 };
+
+static void relay_append(const void *p, size_t len)
+{
+	if ((relay.buf = realloc(relay.buf, relay.len + len)) == NULL)
+		abort();
+	memcpy(relay.buf + relay.len, p, len);
+	relay.len += len;
+}
+
+static void relay_flush(void)
+{
+	ssize_t n;
+
+	while (relay.off < relay.len) {
+		n = send(relay.fd, relay.buf + relay.off,
+			 relay.len - relay.off, MSG_DONTWAIT|MSG_NOSIGNAL);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (n < 0) {
+			close(relay.fd);
+			relay.fd = -1;
+			relay.len = relay.off = 0;
+			return;
+		}
+		relay.off += n;
+	}
+}
+
+static void relay_send(void)
+{
+	static struct matcher all;
+	char hello[160];
+	size_t len;
+	void *tab;
+
+	if (relay.fd >= 0 && relay.off < relay.len) {
+		relay_flush();
+		if (relay.fd >= 0 && relay.off < relay.len) {
+			sstat.relay_skipped++;
+			return;
+		}
+	}
+	relay.len = relay.off = 0;
+
+	if (relay.fd < 0) {
+		if (time(NULL) - relay.tried < RELAY_RETRY)
+			return;
+		relay.tried = time(NULL);
+		sstat.relay_connects++;
+		relay.fd = socket(relay.addr.ss_family,
+				  SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+		if (relay.fd < 0)
+			return;
+		if (connect(relay.fd, (struct sockaddr *)&relay.addr,
+			    relay.alen) && errno != EINPROGRESS) {
+			close(relay.fd);
+			relay.fd = -1;
+			return;
+		}
+		strcpy(hello, "relay ");
+		if (conf.relay_name)
+			snprintf(hello+6, 64, "%s", conf.relay_name);
+		else
+			gethostname(hello+6, 64);
+		hello[6+63] = 0;
+		if (conf.key) {
+			strcat(hello, " ");
+			strcat(hello, conf.key);
+		}
+		strcat(hello, "\n");
+		relay_append(hello, strlen(hello));
+	}
+	tab = bin_stats(bin_table(kern_db, &all, 0, &len), &len);
+	relay_append(tab, len);
+	free(tab);
+	sstat.relayed++;
+	relay_flush();
+}
+
+static void dump_raw_ent(FILE *fp, struct ifstat_ent *n)
+{
+	int i;
+
+	fprintf(fp, "%d %s ", n->ifindex, n->name);
+	for (i=0; i<MAXS; i++) {
+		fprintf(fp, "%" PRIu64 " %u ", n->val[i], (unsigned)n->rate[i]);
+	}
+	/* speed duplex rx_util tx_util saturated */
+	fprintf(fp, "%d %d %.1f %.1f %d\n", link_speed(n), n->duplex,
+		n->util[0], n->util[1], !!(n->flags & IFE_SAT));
+}
+
+static void dump_raw_db(FILE *fp)
+{
+	struct ifstat_ent *n;
+
+	if (!query.binary)
+		fprintf(fp, "#ovrf=%d EWMA=%d client-pid=%u -- %s\n", 
+			overflow, ewma, getpid(), info_source);
+
+	if (!query.binary)
+		dump_stats(fp);
+	if (query.stats && !query.binary)
+		return;
+
+	/* Forked child, the client's patterns replace ours */
+	set_patterns(query.patterns, query.npatterns);
+
+	if (query.families) {
+		dump_families(fp);
+		if (!query.links)
+			return;
+	}
+
+	if (query.est) {
+		est_apply(kern_db, query.est);
+		est_apply(roll_db, query.est);
+	}
+	/* Binary clients get the age in the table header */
+	if (query.token[0] && !query.rollup && !query.binary) {
+		if (query.base)
+			fprintf(fp, "#baseline %s %" PRIu64 "\n", query.token,
+				(now_us() - query.base->created) / 1000);
+		else
+			fprintf(fp, "#baseline %s new\n", query.token);
+	}
+	if (query.token[0] && !query.rollup)
+		base_apply(kern_db, query.base);
+	if (query.rollup)
+		kern_db = roll_db;
+	if (query.sort_key >= 0)
+		sort_db(query.sort_key, query.topn, 1);
+
+	if (query.binary) {
+		size_t len;
+		struct ifstat2_hdr *buf = bin_table(kern_db, NULL, 0, &len);
+
+		if (query.token[0] && !query.rollup)
+			buf->baseline_ms = query.base ?
+				(now_us() - query.base->created) / 1000 : -1;
+		if (query.stats)
+			buf = bin_stats(buf, &len);
+
+		fwrite(buf, 1, len, fp);
+		return;
+	}
+
+	for (n=kern_db; n; n=n->next)
+		if (match_ent(n))
+			dump_raw_ent(fp, n);
+}
+
+/*
+   Output buffer for the human readable views. The whole table is
+   rendered here with hand rolled conversions and written with one
+   write(), instead of a sprintf/fprintf pair for every cell.
+*/
+
+struct obuf {
+	char	*buf;
+	size_t	len;
+	size_t	size;
+};
+
+static void ob_reserve(struct obuf *ob, size_t n)
+{
+	if (ob->len + n <= ob->size)
+		return;
+	ob->size = (ob->len + n) * 2;
+	if ((ob->buf = realloc(ob->buf, ob->size)) == NULL)
+		abort();
+}
+
+static void ob_pad(struct obuf *ob, int n)
+{
+	if (n <= 0)
+		return;
+	ob_reserve(ob, n);
+	memset(ob->buf + ob->len, ' ', n);
+	ob->len += n;
+}
+
+static void ob_mem(struct obuf *ob, const char *s, int n)
+{
+	ob_reserve(ob, n);
+	memcpy(ob->buf + ob->len, s, n);
+	ob->len += n;
+}
+
+/* width < 0 left justifies, as "%-*s" */
+static void ob_str(struct obuf *ob, const char *s, int width)
+{
+	int n = strlen(s);
+
+	if (width > n)
+		ob_pad(ob, width - n);
+	ob_mem(ob, s, n);
+	if (-width > n)
+		ob_pad(ob, -width - n);
+}
+
+static int u64toa(char *p, uint64_t v)
+{
+	char tmp[24];
+	int n = 0, i;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	for (i=0; i<n; i++)
+		p[i] = tmp[n-1-i];
+	return n;
+}
+
+/* v as integer, followed by suffix, justified to width as a whole */
+static void ob_u64(struct obuf *ob, uint64_t v, const char *sfx, int width)
+{
+	char tmp[48];
+	int n = u64toa(tmp, v);
+
+	while (*sfx)
+		tmp[n++] = *sfx++;
+	tmp[n] = 0;
+	ob_str(ob, tmp, width);
+}
+
+/*
+   x with dec decimals rounded as printf does, suffix, justified to
+   width. x*scale is within 1e-7 of the exact product below 1e9, so
+   unless it is that close to a half the nearest integer is printf's;
+   halves and large values go to snprintf.
+*/
+static void ob_fixed(struct obuf *ob, double x, int dec, const char *sfx, int width)
+{
+	char tmp[48];
+	uint64_t scale = 1, v;
+	double y, f;
+	int n, i;
+
+	for (i=0; i<dec; i++)
+		scale *= 10;
+	y = x*scale;
+	if (!(y >= 0 && y < 1e9) || fabs((f = y - floor(y)) - 0.5) < 1e-6) {
+		n = snprintf(tmp, 32, "%.*f", dec, x);
+		if (n > 31)
+			n = 31;
+		while (*sfx)
+			tmp[n++] = *sfx++;
+		tmp[n] = 0;
+		ob_str(ob, tmp, width);
+		return;
+	}
+	v = (uint64_t)floor(y) + (f > 0.5);
+	n = u64toa(tmp, v/scale);
+	if (dec) {
+		tmp[n++] = '.';
+		v %= scale;
+		for (i=dec-1; i>=0; i--) {
+			tmp[n+i] = '0' + v % 10;
+			v /= 10;
+		}
+		n += dec;
+	}
+	while (*sfx)
+		tmp[n++] = *sfx++;
+	tmp[n] = 0;
+	ob_str(ob, tmp, width);
+}
+
+static void ob_flush(struct obuf *ob, FILE *fp)
+{
+	char *p = ob->buf;
+	size_t left = ob->len;
+
+	fflush(fp);
+	while (left) {
+		ssize_t n = write(fileno(fp), p, left);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		p += n;
+		left -= n;
+	}
+	ob->len = 0;
+}
+
+static void format_rate(struct obuf *ob, struct ifstat_ent *n, int i)
+{
+	if (n->rate[i] > 1024*1024)
+		ob_u64(ob, (unsigned)(n->rate[i]/(1024*1024)), "M", -11);
+	else if (n->rate[i] > 1024)
+		ob_u64(ob, (unsigned)(n->rate[i]/1024), "K", -11);
+	else
+		ob_u64(ob, (unsigned)n->rate[i], "", -11);
+	ob_mem(ob, " ", 1);
+}
+
+static void print_head(struct obuf *ob)
+{
+	static const char *ehead[5][4] = {
+		{ "RX Pkts", "TX Pkts", "RX Data", "TX Data" },
+		{ "RX Errs", "RX Drop", "RX Over", "RX Leng" },
+		{ "RX Crc ", "RX Frm ", "RX Fifo", "RX Miss" },
+		{ "TX Errs", "TX Drop", "Colli  ", "TX Carr" },
+		{ "TX Abrt", "TX Fifo", "TX Hbt ", "TX Wind" },
+	};
+	int l, c;
+
+	/* Scripts billing by token need the span too */
+	if (base_info[0]) {
+		ob_str(ob, "#baseline ", 0);
+		ob_str(ob, base_info, 0);
+		ob_mem(ob, "\n", 1);
+	}
+	if(conf.noformat) {
+		return;
+	}
+	
+	if(conf.verbose) {
+		ob_mem(ob, "#", 1);
+		ob_str(ob, info_source, 0);
+		ob_mem(ob, "\n", 1);
+	}
+	if(!conf.show_errors) {
+		ob_str(ob, "RX --------------------------", 42);
+		ob_str(ob, "   TX --------------------------", -30);
+		if (conf.util)
+			ob_str(ob, "RX util TX util", 16);
+		ob_mem(ob, "\n", 1);
+		return;
+	}
+
+	for (l=0; l<5; l++) {
+		ob_str(ob, l ? "" : "Interface", -10);
+		ob_mem(ob, " ", 1);
+		for (c=0; c<4; c++)
+			ob_str(ob, ehead[l][c], 12);
+		ob_mem(ob, "\n", 1);
+	}
+}
+
+static void nformat_rate(struct obuf *ob, double x)
+{
+	uint64_t i = x;
+	
+	if(conf.noformat) {
+		ob_u64(ob, i, " pps ", 0);
+		return;
+	}
+
+	if (i > 1500*1000)
+		ob_fixed(ob, (double)(i/1000)/1000, 3, " M", 10);
+	else if (i > 5*1000)
+		ob_u64(ob, i/1000, " k", 10);
+	else
+		ob_u64(ob, i, "  ", 10);
+
+	ob_mem(ob, " pps ", 5);
+}
+
+static void nformat_bits(struct obuf *ob, double d)
+{
+	if(conf.noformat) {
+		ob_fixed(ob, d*8, 0, " bits/s ", 0);
+		return;
+	}
+
+	/*
+	  IEC standard 1998
+	  kbit = 1000 bits
+	  Mbit = 10^6 bits
+	  Gbit = 10^9 bits
+	*/
+
+        if (d >= 125*1000*1000) 
+		ob_fixed(ob, d/((1000/8)*1000*1000), 1, " G", 10);
+        else if (d >= 125*1000) 
+		ob_fixed(ob, d/((1000/8)*1000), 1, " M", 10);
+        else if (d >= 128) 
+		ob_fixed(ob, d/(1000/8), 1, " k", 10);
+        else 
+		ob_fixed(ob, d*8, 0, "  ", 10);
+
+	ob_mem(ob, " bit/s ", 7);
+}
+
+/* rx and tx percent of link speed, '!' when saturated */
+static void format_util(struct obuf *ob, struct ifstat_ent *n)
+{
+	int w = conf.noformat ? 0 : 7;
+
+	if (!n->speed) {
+		ob_str(ob, "-", w);
+		ob_str(ob, "-", w + 1);
+	} else {
+		ob_fixed(ob, n->util[0], 1, "%", w);
+		ob_mem(ob, " ", 1);
+		ob_fixed(ob, n->util[1], 1, "%", w);
+	}
+	if (n->flags & IFE_SAT)
+		ob_mem(ob, " !", 2);
+}
+
+static void print_one_if(struct obuf *ob, struct ifstat_ent *n)
+{
+	/* -e layout, rows of four counters */
+	static const int erows[5][4] = {
+		{ 0, 1, 2, 3 },
+		{ 4, 6, 11, 10 },	/* rx_err rx_dropped rx_over rx_len */
+		{ 12, 13, 14, 15 },	/* rx_crc rx_frame rx_fifo rx_missed */
+		{ 5, 7, 9, 17 },	/* tx_err tx_dropped collisions tx_carrier */
+		{ 16, 18, 19, 20 },	/* tx_abort tx_fifo tx_hb tx_window */
+	};
+	int l, c;
+
+	if(!conf.show_errors) {
+
+		if(conf.noformat) {
+			ob_str(ob, n->name, 0);
+			ob_mem(ob, " ", 1);
+		} else {
+			ob_str(ob, n->name, -10);
+			ob_mem(ob, " ", 1);
+		}
+		nformat_bits(ob, n->rate[2]);
+		nformat_rate(ob, n->rate[0]);
+		nformat_bits(ob, n->rate[3]);
+		nformat_rate(ob, n->rate[1]);
+		if (conf.util)
+			format_util(ob, n);
+		
+		ob_mem(ob, "\n", 1);
+		
+		return;
+	}  
+
+	for (l=0; l<5; l++) {
+		ob_str(ob, l ? "" : n->name, -15);
+		ob_mem(ob, " ", 1);
+		for (c=0; c<4; c++)
+			format_rate(ob, n, erows[l][c]);
+		ob_mem(ob, "\n", 1);
+	}
+}
+
+
+static void print_softnet(FILE *fp)
+{
+	static const int cols[] = { 0, 1, 2, 9, 10 };
+	struct family *fam = family_find("softnet");
+	struct cnt_ent *c;
+	struct obuf ob;
+	int i;
+
+	memset(&ob, 0, sizeof(ob));
+	ob_reserve(&ob, 4096);
+
+	if (!conf.noformat) {
+		ob_str(&ob, "CPU", -8);
+		for (i = 0; i < 5; i++)
+			ob_str(&ob, fam->names[cols[i]], 14);
+		ob_str(&ob, "backlog", 9);
+		ob_mem(&ob, "\n", 1);
+	}
+	for (c = fam->db; c; c = c->next) {
+		if (!match(c->name))
+			continue;
+		ob_str(&ob, c->name, conf.noformat ? 0 : -8);
+		for (i = 0; i < 5; i++) {
+			ob_mem(&ob, " ", 1);
+			ob_u64(&ob, cols[i] < c->nval ? c->rate[cols[i]] : 0,
+			       "/s", conf.noformat ? 0 : 13);
+		}
+		ob_mem(&ob, " ", 1);
+		ob_u64(&ob, c->nval > 11 ? c->val[11] : 0, "",
+		       conf.noformat ? 0 : 8);
+		ob_mem(&ob, "\n", 1);
+	}
+	ob_flush(&ob, fp);
+	free(ob.buf);
+}
+
+/* Interface packet rates, then the IRQ rate of each queue by CPU */
+static void print_irq(FILE *fp)
+{
+	struct family *fam = family_find("irq");
+	struct ifstat_ent *n = NULL;
+	struct cnt_ent *c;
+	struct obuf ob;
+	int i, w = conf.noformat ? 0 : 10;
+
+	memset(&ob, 0, sizeof(ob));
+	ob_reserve(&ob, 4096);
+
+	for (c = fam->db; c; c = c->next) {
+		char *sub = strchr(c->name, ':');
+		double sum = 0;
+		int len = sub - c->name;
+
+		if (!sub)
+			continue;
+		if (!n || strncmp(n->name, c->name, len) || n->name[len]) {
+			for (n = kern_db; n; n = n->next)
+				if (!strncmp(n->name, c->name, len) &&
+				    !n->name[len])
+					break;
+			if (!n)
+				continue;
+			ob_str(&ob, n->name, conf.noformat ? 0 : -16);
+			ob_mem(&ob, " rx ", 4);
+			nformat_rate(&ob, n->rate[0]);
+			ob_mem(&ob, "tx ", 3);
+			nformat_rate(&ob, n->rate[1]);
+			ob_mem(&ob, "\n", 1);
+		}
+		for (i = 0; i < c->nval; i++)
+			sum += c->rate[i];
+		ob_mem(&ob, "  ", 2);
+		ob_str(&ob, sub + 1, conf.noformat ? 0 : -14);
+		ob_mem(&ob, " irq ", 5);
+		ob_u64(&ob, c->id, "", conf.noformat ? 0 : -5);
+		ob_u64(&ob, sum, "/s", w);
+		for (i = 0; i < c->nval; i++) {
+			if (c->rate[i] < 1)
+				continue;
+			ob_mem(&ob, " cpu", 4);
+			ob_u64(&ob, i, "=", 0);
+			ob_u64(&ob, c->rate[i], "", 0);
+		}
+		ob_mem(&ob, "\n", 1);
+	}
+	ob_flush(&ob, fp);
+	free(ob.buf);
+}
+
+/* Throughput and drop rates per qdisc and class, backlog as is */
+static void print_qdisc(FILE *fp)
+{
+	struct family *fam = family_find("qdisc");
+	struct cnt_ent *c;
+	struct obuf ob;
+	int i, w = conf.noformat ? 0 : 11;
+
+	memset(&ob, 0, sizeof(ob));
+	ob_reserve(&ob, 4096);
+
+	if (!conf.noformat) {
+		ob_str(&ob, "QDISC", -28);
+		ob_str(&ob, "rate", 15);
+		ob_str(&ob, "", 16);
+		for (i = 2; i < 5; i++)
+			ob_str(&ob, fam->names[i], w + 1);
+		ob_str(&ob, "backlog", 10);
+		ob_str(&ob, "qlen", 8);
+		ob_mem(&ob, "\n", 1);
+	}
+	for (c = fam->db; c; c = c->next) {
+		if (c->nval < QDISC_COLS)
+			continue;
+		ob_str(&ob, c->name, conf.noformat ? 0 : -28);
+		ob_mem(&ob, " ", 1);
+		nformat_bits(&ob, c->rate[0]);
+		nformat_rate(&ob, c->rate[1]);
+		for (i = 2; i < 5; i++) {
+			ob_u64(&ob, c->rate[i], "/s", w);
+			ob_mem(&ob, " ", 1);
+		}
+		ob_u64(&ob, c->val[5], "b", conf.noformat ? 0 : 9);
+		ob_mem(&ob, " ", 1);
+		ob_u64(&ob, c->val[6], "p", conf.noformat ? 0 : 7);
+		ob_mem(&ob, "\n", 1);
+	}
+	ob_flush(&ob, fp);
+	free(ob.buf);
+}
+
+/* Protocol counters as nstat shows them, zero counters left out */
+static void print_snmp(FILE *fp)
+{
+	static const char *tags[] = { "snmp", "snmp6", "netstat" };
+	struct cnt_ent *c;
+	struct obuf ob;
+	int f;
+
+	memset(&ob, 0, sizeof(ob));
+	ob_reserve(&ob, 4096);
+
+	for (f = 0; f < 3; f++)
+		for (c = family_find(tags[f])->db; c; c = c->next) {
+			if (!c->val[0] && !c->rate[0])
+				continue;
+			ob_str(&ob, c->name, conf.noformat ? 0 : -32);
+			ob_mem(&ob, " ", 1);
+			ob_u64(&ob, c->val[0], "", conf.noformat ? 0 : 20);
+			ob_mem(&ob, " ", 1);
+			ob_u64(&ob, c->rate[0], "/s", conf.noformat ? 0 : 12);
+			ob_mem(&ob, "\n", 1);
+		}
+	ob_flush(&ob, fp);
+	free(ob.buf);
+}
+
+static void dump_kern_db(FILE *fp)
+{
+	struct ifstat_ent *n;
+	struct obuf ob;
+	int cnt = 0;
+
+	for (n=kern_db; n; n=n->next)
+		cnt++;
+
+	/* Rows are ~90 bytes, 5 rows of ~65 with -e */
+	memset(&ob, 0, sizeof(ob));
+	ob_reserve(&ob, 1024 + cnt * (conf.show_errors ? 5*80 : 96));
+
+	print_head(&ob);
+
+	for (n=kern_db; n; n=n->next) {
+		if (!match_ent(n))
+			continue;
+		print_one_if(&ob, n);
+	}
+	ob_flush(&ob, fp);
+	free(ob.buf);
+}
+
+/*
+   Sample log. With -L DIR the daemon appends every sample to segment
+   files DIR/ifstat2-START.seg, a new one each SEG_SECS or SEG_BYTES,
+   and removes those older than SEG_KEEP. A segment is the magic and
+   records:
+
+     'N' ifindex len name		next interface id
+     'S' dod n (id mask delta...)*n	sample
+
+   all numbers varints. dod is the delta of delta of the sample time in
+   ms since the epoch, zigzag coded; mask has a bit per counter that
+   moved and delta is its zigzag difference from the previous sample of
+   that id in the segment. Only entries sampled by the scan are
+   written. Segments are read back with mmap by ifstat2 -T, without
+   the daemon; a record cut short by a crash ends its segment.
+*/
+#define SEG_MAGIC "IFS2SEG1"
+#define SEG_BYTES (4<<20)
+#define SEG_SECS 3600
+#define SEG_KEEP (14*86400)
+
+struct seg_if {
+	int ifindex;
+	char *name;
+	uint64_t stamp;		/* last written, 0 for none yet */
+	uint64_t val[MAXS];
+};
+
+struct {
+	int fd;
+	time_t start;
+	off_t size;
+	int64_t t, dt;		/* last sample time and delta, ms */
+	struct seg_if *ifs;
+	int nifs, hint;
+	unsigned char *buf;
+	size_t bufsize;
+} seg = { -1 };
+
+#define ZIGZAG(v)	(((uint64_t)(v) << 1) ^ (uint64_t)((int64_t)(v) >> 63))
+#define UNZIGZAG(v)	((int64_t)((v) >> 1) ^ -(int64_t)((v) & 1))
+
+static void seg_prune(time_t now)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	long long start;
+	DIR *dir;
+
+	if ((dir = opendir(conf.logdir)) == NULL)
+		return;
+	while ((d = readdir(dir)) != NULL)
+		if (sscanf(d->d_name, "ifstat2-%lld.seg", &start) == 1 &&
+		    start < now - SEG_KEEP) {
+			snprintf(path, sizeof(path), "%s/%s", conf.logdir,
+				 d->d_name);
+			unlink(path);
+		}
+	closedir(dir);
+}
+
+static void seg_close(void)
+{
+	int i;
+
+	if (seg.fd >= 0)
+		close(seg.fd);
+	seg.fd = -1;
+	for (i = 0; i < seg.nifs; i++)
+		free(seg.ifs[i].name);
+	seg.nifs = 0;
+	seg.t = seg.dt = 0;
+}
+
+static int seg_open(time_t now)
+{
+	char path[PATH_MAX];
+
+	seg_close();
+	seg_prune(now);
+	snprintf(path, sizeof(path), "%s/ifstat2-%lld.seg", conf.logdir,
+		 (long long)now);
+	seg.fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (seg.fd < 0)
+		return -1;
+	seg.start = now;
+	seg.size = strlen(SEG_MAGIC);
+	if (write(seg.fd, SEG_MAGIC, seg.size) != seg.size) {
+		seg_close();
+		return -1;
+	}
+	return 0;
+}
+
+/* The entries of a scan come in the order of the last one */
+static struct seg_if *seg_find(struct ifstat_ent *n, int *new)
+{
+	struct seg_if *f;
+	int i, k;
+
+	for (k = 0; k < seg.nifs; k++) {
+		i = (seg.hint + k) % seg.nifs;
+		f = &seg.ifs[i];
+		if (f->ifindex == n->ifindex && !strcmp(f->name, n->name)) {
+			seg.hint = i + 1;
+			*new = 0;
+			return f;
+		}
+	}
+	if ((seg.nifs & 63) == 0 &&
+	    (seg.ifs = realloc(seg.ifs, (seg.nifs + 64) * sizeof(*f))) == NULL)
+		abort();
+	f = &seg.ifs[seg.nifs++];
+	memset(f, 0, sizeof(*f));
+	f->ifindex = n->ifindex;
+	if ((f->name = strdup(n->name)) == NULL)
+		abort();
+	*new = 1;
+	return f;
+}
+
+static void seg_append(void)
+{
+	struct ifstat_ent *n;
+	struct timeval tv;
+	unsigned char *p, *cnt;
+	int64_t t, dt;
+	size_t need;
+	int i, k, new, nent = 0;
+
+	gettimeofday(&tv, NULL);
+	if ((seg.fd < 0 || seg.size >= SEG_BYTES ||
+	     tv.tv_sec - seg.start >= SEG_SECS) && seg_open(tv.tv_sec) < 0)
+		return;
+
+	/* Worst case an 'N' record and a full entry per interface */
+	need = 32;
+	for (n = kern_db; n; n = n->next)
+		need += 2*10 + strlen(n->name) + 2 + (MAXS+2) * 10;
+	if (need > seg.bufsize) {
+		seg.bufsize = need;
+		if ((seg.buf = realloc(seg.buf, need)) == NULL)
+			abort();
+	}
+
+	/* Names first, then the sample */
+	p = seg.buf;
+	for (n = kern_db; n; n = n->next) {
+		seg_find(n, &new);
+		if (!new)
+			continue;
+		*p++ = 'N';
+		p = put_varint(p, n->ifindex);
+		p = put_varint(p, strlen(n->name));
+		memcpy(p, n->name, strlen(n->name));
+		p += strlen(n->name);
+	}
+	t = (int64_t)tv.tv_sec*1000 + tv.tv_usec/1000;
+	dt = t - seg.t;
+	*p++ = 'S';
+	p = put_varint(p, ZIGZAG(dt - seg.dt));
+	seg.t = t;
+	seg.dt = dt;
+	cnt = p;
+	p += 5;		/* count, a fixed width varint */
+	for (n = kern_db; n; n = n->next) {
+		struct seg_if *f = seg_find(n, &new);
+		uint32_t mask = 0;
+
+		if (f->stamp == n->stamp)
+			continue;
+		f->stamp = n->stamp;
+		for (i = 0; i < MAXS; i++)
+			if (n->val[i] != f->val[i])
+				mask |= 1 << i;
+		p = put_varint(p, f - seg.ifs);
+		p = put_varint(p, mask);
+		for (i = 0; i < MAXS; i++)
+			if (mask & (1 << i)) {
+				p = put_varint(p, ZIGZAG(n->val[i] - f->val[i]));
+				f->val[i] = n->val[i];
+			}
+		nent++;
+	}
+	for (k = 0; k < 4; k++)
+		cnt[k] = (nent >> (7*k)) | 0x80;
+	cnt[4] = nent >> 28;
+
+	if (write(seg.fd, seg.buf, p - seg.buf) != p - seg.buf) {
+		/* A torn record would end the segment, start over */
+		seg_close();
+		return;
+	}
+	seg.size += p - seg.buf;
+}
+
+/* Bounded varint read, NULL past end */
+static const unsigned char *seg_varint(const unsigned char *p,
+				       const unsigned char *end, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	do {
+		if (p >= end || shift > 63)
+			return NULL;
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	return p;
+}
+
+/* Per interface name over the range, summed across counter resets */
+struct hist_ent {
+	struct hist_ent *next;
+	char *name;
+	int64_t first, last;	/* ms */
+	uint64_t val[MAXS];	/* last seen */
+	uint64_t sum[MAXS];
+	double max[MAXS];	/* per second */
+};
+
+static struct hist_ent *hist_db;
+
+/* Looked up once per name and segment, not per record */
+static struct hist_ent *hist_get(const char *name)
+{
+	struct hist_ent *h;
+
+	for (h = hist_db; h; h = h->next)
+		if (!strcmp(h->name, name))
+			return h;
+	if ((h = calloc(1, sizeof(*h))) == NULL ||
+	    (h->name = strdup(name)) == NULL)
+		abort();
+	h->next = hist_db;
+	hist_db = h;
+	return h;
+}
+
+static void hist_feed(struct hist_ent *h, int64_t t, uint64_t *val)
+{
+	int i;
+
+	if (!h->last) {
+		h->first = h->last = t;
+		memcpy(h->val, val, sizeof(h->val));
+		return;
+	}
+	if (t <= h->last)
+		return;
+	for (i = 0; i < MAXS; i++) {
+		uint64_t d = val[i] >= h->val[i] ? val[i] - h->val[i] : val[i];
+		double r = (double)d * 1000 / (t - h->last);
+
+		h->sum[i] += d;
+		if (r > h->max[i])
+			h->max[i] = r;
+		h->val[i] = val[i];
+	}
+	h->last = t;
+}
+
+static void seg_read(const unsigned char *p, const unsigned char *end)
+{
+	struct seg_if *ifs = NULL;
+	struct hist_ent **hist = NULL;
+	int nifs = 0, i, k;
+	int64_t t = 0, dt = 0;
+	uint64_t v, len, cnt, id, mask;
+
+	p += strlen(SEG_MAGIC);
+	while (p < end) {
+		if (*p == 'N') {
+			if (!(p = seg_varint(p+1, end, &v)) ||
+			    !(p = seg_varint(p, end, &len)) ||
+			    len >= IFNAMSIZ || len > (uint64_t)(end - p))
+				break;
+			if ((nifs & 63) == 0 &&
+			    ((ifs = realloc(ifs, (nifs + 64) * sizeof(*ifs))) == NULL ||
+			     (hist = realloc(hist, (nifs + 64) * sizeof(*hist))) == NULL))
+				abort();
+			memset(&ifs[nifs], 0, sizeof(*ifs));
+			ifs[nifs].ifindex = v;
+			if ((ifs[nifs].name = strndup((const char *)p, len)) == NULL)
+				abort();
+			hist[nifs] = match(ifs[nifs].name) ?
+				hist_get(ifs[nifs].name) : NULL;
+			nifs++;
+			p += len;
+		} else if (*p == 'S') {
+			if (!(p = seg_varint(p+1, end, &v)) ||
+			    !(p = seg_varint(p, end, &cnt)))
+				break;
+			dt += UNZIGZAG(v);
+			t += dt;
+			for (k = 0; k < cnt && p; k++) {
+				if (!(p = seg_varint(p, end, &id)) || id >= nifs ||
+				    !(p = seg_varint(p, end, &mask)))
+					p = NULL;
+				for (i = 0; i < MAXS && p; i++)
+					if (mask & (1 << i) &&
+					    (p = seg_varint(p, end, &v)))
+						ifs[id].val[i] += UNZIGZAG(v);
+				if (p && hist[id] && t >= conf.from*1000 &&
+				    t <= conf.to*1000)
+					hist_feed(hist[id], t, ifs[id].val);
+			}
+			if (!p)
+				break;
+		} else
+			break;
+	}
+	for (i = 0; i < nifs; i++)
+		free(ifs[i].name);
+	free(ifs);
+	free(hist);
+}
+
+static int seg_cmp(const void *a, const void *b)
+{
+	long long x = 0, y = 0;
+
+	sscanf(*(char **)a, "ifstat2-%lld", &x);
+	sscanf(*(char **)b, "ifstat2-%lld", &y);
+	return x < y ? -1 : x > y;
+}
+
+static void load_history(void)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	struct stat st;
+	long long start;
+	DIR *dir;
+	char **names = NULL;
+	int nnames = 0, i, fd;
+
+	if ((dir = opendir(conf.logdir)) == NULL) {
+		perror("ifstat: opendir");
+		exit(1);
+	}
+	while ((d = readdir(dir)) != NULL)
+		if (sscanf(d->d_name, "ifstat2-%lld.seg", &start) == 1 &&
+		    start <= conf.to) {
+			if ((names = realloc(names, (nnames+1) * sizeof(*names))) == NULL ||
+			    (names[nnames++] = strdup(d->d_name)) == NULL)
+				abort();
+		}
+	closedir(dir);
+
+	/* In time order, so counters run on across segments */
+	qsort(names, nnames, sizeof(*names), seg_cmp);
+	for (i = 0; i < nnames; i++) {
+		void *m;
+
+		snprintf(path, sizeof(path), "%s/%s", conf.logdir, names[i]);
+		free(names[i]);
+		if ((fd = open(path, O_RDONLY)) < 0)
+			continue;
+		if (fstat(fd, &st) || st.st_mtime < conf.from ||
+		    st.st_size < (off_t)strlen(SEG_MAGIC) ||
+		    (m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+		    == MAP_FAILED) {
+			close(fd);
+			continue;
+		}
+		if (!memcmp(m, SEG_MAGIC, strlen(SEG_MAGIC)))
+			seg_read(m, (unsigned char *)m + st.st_size);
+		munmap(m, st.st_size);
+		close(fd);
+	}
+	free(names);
+}
+
+/* Exact average over the range, then the highest rate between samples */
+static void print_history(FILE *fp)
+{
+	struct ifstat_ent e;
+	struct hist_ent *h;
+	struct obuf ob;
+	char name[IFNAMSIZ+8];
+	int i;
+
+	memset(&ob, 0, sizeof(ob));
+	ob_reserve(&ob, 4096);
+	print_head(&ob);
+
+	memset(&e, 0, sizeof(e));
+	e.name = name;
+	for (h = hist_db; h; h = h->next) {
+		if (h->last == h->first)
+			continue;
+		snprintf(name, sizeof(name), "%s", h->name);
+		for (i = 0; i < MAXS; i++)
+			e.rate[i] = (double)h->sum[i] * 1000 / (h->last - h->first);
+		print_one_if(&ob, &e);
+		snprintf(name, sizeof(name), "%s/max", h->name);
+		for (i = 0; i < MAXS; i++)
+			e.rate[i] = h->max[i];
+		print_one_if(&ob, &e);
+	}
+	ob_flush(&ob, fp);
+	free(ob.buf);
+}
+
+static int children;
+
+/*
+   Query children by start, the serve stage is taken when one is
+   reaped: the request, any scan for it and the child's dump.
+*/
+#define MAX_CHILDREN 5
+
+static struct {
+	pid_t pid;
+	uint64_t t0;
+} kids[MAX_CHILDREN];
+
+static void kid_start(pid_t pid, uint64_t t0)
+{
+	int i;
+
+	for (i = 0; i < MAX_CHILDREN; i++)
+		if (!kids[i].pid) {
+			kids[i].pid = pid;
+			kids[i].t0 = t0;
+			return;
+		}
+}
+
+static void kid_done(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < MAX_CHILDREN; i++)
+		if (kids[i].pid == pid) {
+			hist_add(&sstat.stage[ST_SERVE], now_us() - kids[i].t0);
+			kids[i].pid = 0;
+			return;
+		}
+}
+
+void sigchild(int signo)
+{
+}
+
+static void update_db(int interval)
+{
+	struct ifstat_ent *n, *is_new, *ns;
+	uint64_t t0, t1, t2;
+	int nold = 0, nmatch = 0;
+	int i;
+
+	t0 = now_us();
+	is_new = load_info();
+
+	t1 = now_us();
+	hist_add(&sstat.stage[ST_DUMP], t1 - t0);
+
+	for (n = kern_db; n; n = n->next)
+		nold++;
+
+	/* 
+	   Update current as template to detect any
+	   new or removed devs.
+	*/
+	hash_db(kern_db);
+	for (ns = is_new; ns; ns = ns->next) {
+		double ms;
+
+		if(!conf.scan_interval) 
+			abort();
+
+		if ((n = idx_lookup(ns->ifindex)) == NULL) {
+			if (sstat.scans)
+				sstat.if_added++;
+			rule_match(ns);
+			speed_update(ns, NULL);
+			set_util(ns);
+			continue;
+		}
+
+		n->flags |= IFE_SEEN;
+
+		/* Entries carried over by targeted scans have their own age */
+		ms = (double)(ns->stamp - n->stamp) / 1000;
+
+		/* Rule state follows the ifindex, matching the name */
+		if (strcmp(ns->name, n->name))
+			rule_match(ns);
+		else {
+			ns->rules = n->rules;
+			memcpy(ns->rcount, n->rcount, sizeof(ns->rcount));
+			ns->pm = n->pm;
+			ns->wm = n->wm;
+			ns->gm = n->gm;
+			ns->groups = n->groups;
+		}
+
+		/* The first rates are the sample, not an average from zero */
+		if (n->flags & IFE_RATED)
+			update_rates(ns->val, ns->rate, n->val, n->rate, MAXS,
+				     ms);
+		else if (ms > conf.min_interval)
+			for (i = 0; i < MAXS; i++)
+				ns->rate[i] = ns->val[i] < n->val[i] ? 0 :
+					(double)((ns->val[i] - n->val[i])*1000) /
+					ms;
+		if ((n->flags & IFE_RATED) || ms > conf.min_interval)
+			ns->flags |= IFE_RATED;
+		update_est(ns, n, ms);
+		ns->quiet = memcmp(ns->val, n->val, sizeof(ns->val)) ? 0 :
+			n->quiet < 255 ? n->quiet + 1 : 255;
+		speed_update(ns, n);
+		set_util(ns);
+		nmatch++;
+	}
+	if (sstat.scans && !scan_partial)
+		sstat.if_removed += nold - nmatch;
+
+	/*
+	   Remove old table. A targeted scan only read the watched
+	   interfaces, the others are kept as they were, in place.
+	*/
+	if (scan_partial) {
+		struct ifstat_ent *merged = NULL, **tail = &merged;
+
+		/* New entries come in the order of the old ones */
+		ns = is_new;
+		while (kern_db) {
+			n = kern_db;
+			kern_db = n->next;
+			if (!(n->flags & IFE_SEEN)) {
+				*tail = n;
+				tail = &n->next;
+				continue;
+			}
+			if (ns && ns->ifindex == n->ifindex) {
+				*tail = ns;
+				tail = &ns->next;
+				ns = ns->next;
+			}
+			free_ent(n);
+		}
+		*tail = ns;
+		is_new = merged;
+	} else
+		free_db(kern_db);
+	kern_db = is_new; /* The most recent devs from rt_netlink */
+	hash_db(kern_db);
+	ctr_update();
+	update_rollups();
+
+	for (i = 0; i < NFAMILIES; i++)
+		update_family(&families[i]);
+	if (conf.logdir)
+		seg_append();
+
+	t2 = now_us();
+	hist_add(&sstat.stage[ST_UPDATE], t2 - t1);
+	hist_add(&sstat.stage[ST_SCAN], t2 - t0);
+	sstat.scans++;
+}
+
+/* Sample at the finest interval any profile asks for */
+static void est_resolution(void)
+{
+	int j;
+
+	scan_ms = conf.scan_interval;
+	for (j = 1; j < nest; j++)
+		if (est[j].name[0] && est[j].scan_interval &&
+		    est[j].scan_interval < scan_ms)
+			scan_ms = est[j].scan_interval < MIN_SCAN ?
+				MIN_SCAN : est[j].scan_interval;
+}
+
+/*
+   Profile by name, set up or updated with the settings given, 0 when
+   all slots are held. Only root and the daemon's owner may sample
+   faster than the daemon's interval.
+*/
+static int est_get(uid_t uid, const char *name, int si, int tc)
+{
+	time_t now = time(NULL);
+	int j, slot = 0;
+
+	for (j = 1; j < nest; j++)
+		if (est[j].uid == uid && !strcmp(est[j].name, name))
+			break;
+	if (j == nest) {
+		for (j = 1; j < MAX_EST; j++) {
+			if (!est[j].name[0])
+				break;
+			if (!est[j].refs && (!slot || est[j].last < est[slot].last))
+				slot = j;
+		}
+		if (j == MAX_EST && (j = slot) == 0)
+			return 0;
+		memset(&est[j], 0, sizeof(est[j]));
+		strncpy(est[j].name, name, sizeof(est[j].name)-1);
+		est[j].uid = uid;
+		est[j].time_constant = conf.time_constant;
+		est[j].born = sstat.scans;
+		if (j >= nest)
+			nest = j+1;
+	}
+	if (si > 0 && si < conf.scan_interval && uid && uid != getuid())
+		si = conf.scan_interval;
+	if (si > 0)
+		est[j].scan_interval = si;
+	if (tc > 0)
+		est[j].time_constant = tc;
+	est[j].last = now;
+	est_resolution();
+	return j;
+}
+
+static void user_set(struct user *u, int j)
+{
+	if (u->est)
+		est[u->est].refs--;
+	u->est = j;
+	if (j)
+		est[j].refs++;
+}
+
+static struct user *user_find(uid_t uid)
+{
+	struct user *u, *old = users;
+
+	for (u = users; u < users + nusers; u++) {
+		if (u->uid == uid)
+			return u;
+		if (u->last < old->last)
+			old = u;
+	}
+	if (nusers < MAX_USERS)
+		u = &users[nusers++];
+	else {
+		u = old;
+		user_set(u, 0);
+	}
+	memset(u, 0, sizeof(*u));
+	u->uid = uid;
+	return u;
+}
+
+/* Idle users let go of their profile, unheld profiles time out */
+static void est_expire(void)
+{
+	time_t now = time(NULL);
+	int i, j, changed = 0;
+
+	for (i = 0; i < nusers; i++)
+		if (users[i].est && now - users[i].last > USER_TTL)
+			user_set(&users[i], 0);
+	for (j = 1; j < nest; j++)
+		if (est[j].name[0] && !est[j].refs &&
+		    now - est[j].last > EST_TTL) {
+			est[j].name[0] = 0;
+			changed = 1;
+		}
+	while (nest > 1 && !est[nest-1].name[0])
+		nest--;
+	if (changed)
+		est_resolution();
+}
+
+static char *cmd_arg(char *line, const char *pfx)
+{
+	int len = strlen(pfx);
+
+	return strncmp(line, pfx, len) ? NULL : line + len;
+}
+
+static void client_cmd(char *line)
+{
+	char *arg;
+
+	if (!strcmp(line, "stats"))
+		query.stats = 1;
+	else if (!strcmp(line, "rollup"))
+		query.rollup = 1;
+	else if (!strcmp(line, "events"))
+		query.events = 1;
+	else if (!strcmp(line, "links"))
+		query.links = 1;
+	else if (!strcmp(line, "binary"))
+		query.binary = 1;
+	else if (!strcmp(line, "subscribe"))
+		query.subscribe = 1;
+	else if ((arg = cmd_arg(line, "sort="))) {
+		/* An index from ifstat2, a name from libifstat2 */
+		query.sort_key = isdigit(*arg) ? atoi(arg) : counter_index(arg);
+		if (query.sort_key >= NKEYS)
+			query.sort_key = -1;
+	} else if ((arg = cmd_arg(line, "top=")))
+		query.topn = atoi(arg);
+	else if ((arg = cmd_arg(line, "family="))) {
+		struct family *fam = family_find(arg);
+
+		if (fam) {
+			query.families |= 1 << (fam - families);
+			if (fam->demand &&
+			    time(NULL) - fam->last_query > WATCH_TTL)
+				query.fresh = 1;
+			fam->last_query = time(NULL);
+		}
+	} else if ((arg = cmd_arg(line, "match="))) {
+		if (query.npatterns < MAX_QPAT)
+			query.patterns[query.npatterns++] = strdup(arg);
+	} else if ((arg = cmd_arg(line, "baseline=")))
+		strncpy(query.token, arg, sizeof(query.token)-1);
+	else if ((arg = cmd_arg(line, "profile=")))
+		strncpy(query.profile, arg, sizeof(query.profile)-1);
+	else if ((arg = cmd_arg(line, "scan_interval=")))
+		query.scan_interval = atoi(arg);
+	else if ((arg = cmd_arg(line, "time_constant=")))
+		query.time_constant = atoi(arg);
+}
+
+int peer_uid(int fd, uid_t *uid)
+{
+	struct ucred cred;
+	unsigned int olen = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, (void*)&cred, &olen) ||
+	    olen < sizeof(cred))
+		return -1;
+	*uid = cred.uid;
+	return 0;
+}
+
+/*
+   Settings go to a profile of their own, never to the daemon's.
+   Queries without one get the daemon's rates.
+*/
+static void query_profile(void)
+{
+	if (!query.profile[0] && (query.scan_interval || query.time_constant))
+		snprintf(query.profile, sizeof(query.profile), "d%dt%d",
+			 query.scan_interval, query.time_constant);
+	if (query.profile[0]) {
+		query.est = est_get(query.uid, query.profile,
+				    query.scan_interval, query.time_constant);
+		if (query.user)
+			user_set(query.user, query.est);
+	}
+	if (query.est)
+		est[query.est].last = time(NULL);
+	if (query.user)
+		query.user->last = time(NULL);
+}
+
+/* The request is sent in one write, taken as it is when late */
+static int read_client(int fd, uid_t uid)
+{
+	char buf[4096], *line, *save;
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < query.npatterns; i++)
+		free(query.patterns[i]);
+	memset(&query, 0, sizeof(query));
+	query.sort_key = -1;
+	query.uid = uid;
+	if (getuid() == 0)
+		query.user = user_find(uid);
+
+	n = recv(fd, buf, sizeof(buf)-1, MSG_DONTWAIT);
+	if(n > 0) {
+		buf[n] = 0;
+		for (line = strtok_r(buf, "\n", &save); line;
+		     line = strtok_r(NULL, "\n", &save))
+			client_cmd(line);
+		query_profile();
+
+		/* Feed the watched set */
+		if ((query.stats && !query.binary) || query.events ||
+		    (query.families && !query.links))
+			return 0;
+		if (query.rollup || !query.npatterns)
+			watch.full = time(NULL);
+		else
+			for (i = 0; i < query.npatterns; i++)
+				watch_add(query.patterns[i], time(NULL));
+
+		/* Interfaces left out of targeted scans may be stale */
+		if (scan_partial && (watch.changed || watch.full == time(NULL)))
+			query.fresh = 1;
+		return 0;
+	}
+	return -1;
+}
+
+#define T_DIFF(a,b) (((a).tv_sec-(b).tv_sec)*1000 + ((a).tv_usec-(b).tv_usec)/1000)
+
+/*
+   Warm start. The daemon checkpoints its table, counters, rates and
+   sample times by ifindex and name, every STATE_SAVE seconds and on
+   SIGTERM/SIGINT. A new daemon takes it up when it is from this boot
+   and younger than the time constant, else it samples twice BOOT_MS
+   apart so the first query has rates.
+*/
+#define STATE_SAVE 60
+#define BOOT_MS 50
+
+static volatile sig_atomic_t stopping;
+
+static void sigstop(int signo)
+{
+	stopping = 1;
+}
+
+static void state_path(char *path, size_t size)
+{
+	char *p = getenv("IFSTAT2_HISTORY");
+
+	if (p)
+		snprintf(path, size, "%s", p);
+	else
+		snprintf(path, size, "/tmp/.ifstat2.u%d", getuid());
+}
+
+static void boot_id(char *id, size_t size)
+{
+	FILE *fp;
+
+	id[0] = 0;
+	if ((fp = fopen("/proc/sys/kernel/random/boot_id", "r")) == NULL)
 		return;
-	}  
+	if (fgets(id, size, fp))
+		id[strcspn(id, "\n")] = 0;
+	fclose(fp);
+}
+
+static void state_save(void)
+{
+	char path[PATH_MAX], tmp[PATH_MAX+4], id[64];
+	struct ifstat_ent *n;
+	FILE *fp;
+	int fd, i;
+
+	state_path(path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.new", path);
+	unlink(tmp);
+	if ((fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600)) < 0)
+		return;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	boot_id(id, sizeof(id));
+	fprintf(fp, "#ifstat2 " VERSION " %s %lld\n", id, (long long)time(NULL));
+	for (n = kern_db; n; n = n->next) {
+		fprintf(fp, "%d %s %llu %d", n->ifindex, n->name,
+			(unsigned long long)n->stamp, !!(n->flags & IFE_RATED));
+		for (i = 0; i < MAXS; i++)
+			fprintf(fp, " %llu %.1f",
+				(unsigned long long)n->val[i], n->rate[i]);
+		fprintf(fp, "\n");
+	}
+	if (fclose(fp) || rename(tmp, path))
+		unlink(tmp);
+}
+
+/* Saved entries that still have their ifindex and name, or NULL */
+static struct ifstat_ent *state_load(void)
+{
+	char path[PATH_MAX], id[64], sid[64], buf[4096];
+	struct ifstat_ent *cur, *db = NULL, **tail = &db, *n;
+	long long saved;
+	struct stat st;
+	FILE *fp;
+	int fd;
+
+	state_path(path, sizeof(path));
+	if ((fd = open(path, O_RDONLY|O_NOFOLLOW)) < 0)
+		return NULL;
+	if (fstat(fd, &st) || st.st_uid != getuid() ||
+	    (fp = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	boot_id(id, sizeof(id));
+	if (!fgets(buf, sizeof(buf), fp) ||
+	    sscanf(buf, "#ifstat2 " VERSION " %63s %lld", sid, &saved) != 2 ||
+	    strcmp(id, sid) || time(NULL) - saved < 0 ||
+	    (time(NULL) - saved) * 1000 > conf.time_constant) {
+		fclose(fp);
+		return NULL;
+	}
+
+	cur = load_info();
+	hash_db(cur);
+	while (fgets(buf, sizeof(buf), fp)) {
+		char *p = buf, *name;
+		int ifindex, rated, i;
+		struct ifstat_ent *c;
+
+		ifindex = strtol(p, &p, 10);
+		name = strtok_r(p, " ", &p);
+		if (!name || (c = idx_lookup(ifindex)) == NULL ||
+		    strcmp(c->name, name))
+			continue;
+		if ((n = calloc(1, sizeof(*n))) == NULL ||
+		    (n->name = strdup(name)) == NULL)
+			abort();
+		n->ifindex = ifindex;
+		n->stamp = strtoull(p, &p, 10);
+		rated = strtol(p, &p, 10);
+		for (i = 0; i < MAXS; i++) {
+			n->val[i] = strtoull(p, &p, 10);
+			n->rate[i] = strtod(p, &p);
+		}
+		if (rated)
+			n->flags |= IFE_RATED;
+		*tail = n;
+		tail = &n->next;
+	}
+	fclose(fp);
+	free_db(cur);
+	hash_db(db);
+	return db;
+}
+
+/*
+   Clients. A client is accepted into the pending set and served once
+   its request is in, or REQ_WAIT ms later with the defaults, so the
+   sampler never waits on one. The forked child writes its copy of the
+   last sample; a sample is taken for the query only when that one is
+   older than the scan interval, after an idle spell, or lacks what the
+   query asks for. Such a sample leaves snaptime alone, the next
+   scheduled one comes when it would have. The fork itself is done in
+   the loop, between ticks.
+*/
+#define MAX_PEND 16
+#define REQ_WAIT 100	/* ms */
+
+struct pend {
+	int fd;
+	uid_t uid;
+	uint64_t since;		/* us */
+} pend[MAX_PEND];
+int npend;
+
+static void serve_client(int clnt, uid_t uid, const struct timeval *snaptime)
+{
+	struct timeval now;
+	uint64_t t0 = now_us();
+	pid_t pid;
+	int swapped = 0;
+
+	/* Request first, it may change the watched set */
+	read_client(clnt, uid);
+
+	gettimeofday(&now, NULL);
+	if (query.fresh || T_DIFF(now, *snaptime) >= scan_ms) {
+		scan_query = 1;
+		update_db(T_DIFF(now, *snaptime));
+		scan_query = 0;
+		sstat.query_scans++;
+	}
+
+	sprintf(info_source,
+		"pid=%d sampling_interval=%d "
+		"time_const=%d profile=%s",
+		getpid(),
+		scan_ms/1000,
+		(query.est ? est[query.est].time_constant :
+		 conf.time_constant)/1000,
+		query.est ? est[query.est].name : "-");
+
+	sstat.queries++;
+
+	if (query.events) {
+		if (nsubs < MAX_SUBS)
+			subs[nsubs++] = clnt;
+		else {
+			sstat.dropped++;
+			close(clnt);
+		}
+		return;
+	}
+	if (query.subscribe) {
+		struct tsub *t = &tsubs[ntsubs];
+
+		if (ntsubs == MAX_TSUBS) {
+			sstat.dropped++;
+			close(clnt);
+			return;
+		}
+		t->fd = clnt;
+		matcher_set(&t->m, query.patterns, query.npatterns);
+		t->rollup = query.rollup;
+		t->est = query.est;
+		if (t->est)
+			strcpy(t->profile, est[t->est].name);
+		t->uid = query.uid;
+		ntsubs++;
+		tsub_send(ntsubs-1);
+		return;
+	}
+	if (children >= MAX_CHILDREN) {
+		sstat.dropped++;
+		close(clnt);
+		return;
+	}
 
+	/* The child gets the old baseline */
+	if (query.token[0] && !query.rollup && !query.stats) {
+		query.base = base_swap(uid, query.token);
+		swapped = 1;
+	}
+	if ((pid = fork()) != 0) {
+		if (pid > 0) {
+			kid_start(pid, t0);
+			children++;
+		} else if (swapped) {
+			base_undo(query.base);
+			query.base = NULL;
+		}
+		base_free(query.base);
+		query.base = NULL;
+		close(clnt);
+	} else {
+		FILE *fp = fdopen(clnt, "w");
+
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		if (fp) {
+			/* Write on clients socket */
+			dump_raw_db(fp);
+		}
+		exit(0);
+	}
+}
 
-	fprintf(fp, "%-15s ", n->name);
-	for (i=0; i<4; i++)
-		format_rate(fp, n, i);
-	fprintf(fp, "\n");
-
-	fprintf(fp, "%-15s ", "");
-	format_rate(fp, n, 4); /* rx_err */
-	format_rate(fp, n, 6); /* rx_dropped */
-	format_rate(fp, n, 11);/* rx_over_err */
-	format_rate(fp, n, 10); /* rx_len_err */
-	fprintf(fp, "\n");
-
-	fprintf(fp, "%-15s ", "");
-	format_rate(fp, n, 12); /* rx_crc_err */
-	format_rate(fp, n, 13); /* rx_frame_err */
-	format_rate(fp, n, 14); /* rx_fifo_err */
-	format_rate(fp, n, 15); /* rx_missed_err */
-	fprintf(fp, "\n");
+static void server_loop(int fd)
+{
+	struct ifstat_ent *n;
+	struct timeval snaptime, ruletime;
+	struct pollfd p[1+MAX_PEND+MAX_SUBS+MAX_TSUBS];
+	time_t saved = time(NULL), last_query = time(NULL);
+	int period = scan_ms;
 	
-	fprintf(fp, "%-15s ", "");
-	format_rate(fp, n, 5); /* tx_err */
-	format_rate(fp, n, 7); /* tx_dropped */
-	format_rate(fp, n, 9); /* collisons */
-	format_rate(fp, n, 17); 
-	fprintf(fp, "\n");
+	memset(&snaptime, 0, sizeof(snaptime));
+	memset(&ruletime, 0, sizeof(ruletime));
 	
-	fprintf(fp, "%-15s ", "");
-	format_rate(fp, n, 16);
-	format_rate(fp, n, 18);
-	format_rate(fp, n, 19);
-	format_rate(fp, n, 20);
-	fprintf(fp, "\n");
+	p[0].fd = fd;
+	p[0].events = POLLIN;
+
+	watch_init();
+	if ((kern_db = state_load()) == NULL) {
+		kern_db = load_info();
+		usleep(BOOT_MS*1000);
+	}
+	for (n = kern_db; n; n = n->next)
+		rule_match(n);
+
+	for (;;) {
+		int status;
+		pid_t pid;
+		int tdiff, wait;
+		int i, np;
+		struct timeval now;
+		uint64_t t;
+
+		gettimeofday(&now, NULL);
+		tdiff = T_DIFF(now, snaptime);
+
+		/* Sample on schedule only, clients do not move it */
+		if (tdiff >= period - conf.min_interval) { 
+			if (sstat.scans &&
+			    tdiff > period + conf.min_interval)
+				sstat.missed++;
+			tsub_watch();
+			if (conf.relay)
+				watch.full = time(NULL);
+			update_db(tdiff);
+			for (i = ntsubs-1; i >= 0; i--)
+				tsub_send(i);
+			if (conf.relay)
+				relay_send();
+
+			/* Rules keep the daemon's interval */
+			if (T_DIFF(now, ruletime) >=
+			    conf.scan_interval - conf.min_interval) {
+				eval_rules();
+				ruletime = now;
+			}
+			est_expire();
+			snaptime = now;
+			tdiff = 0;
+		}
+		if (time(NULL) - saved >= STATE_SAVE) {
+			state_save();
+			saved = time(NULL);
+		}
+
+		/* Pending clients, then subscribers, which only send to close */
+		np = npend;
+		for (i = 0; i < np; i++) {
+			p[1+i].fd = pend[i].fd;
+			p[1+i].events = POLLIN;
+			p[1+i].revents = 0;
+		}
+		for (i = 0; i < nsubs; i++) {
+			p[1+np+i].fd = subs[i];
+			p[1+np+i].events = POLLIN;
+			p[1+np+i].revents = 0;
+		}
+		for (i = 0; i < ntsubs; i++) {
+			p[1+np+nsubs+i].fd = tsubs[i].fd;
+			p[1+np+nsubs+i].events = POLLIN |
+				(tsubs[i].off < tsubs[i].len ? POLLOUT : 0);
+			p[1+np+nsubs+i].revents = 0;
+		}
+		p[0].revents = 0;
+
+		/* No one to sample for */
+		period = scan_ms;
+		if (!nsubs && !ntsubs && !nrules && !conf.relay &&
+		    time(NULL) - last_query > IDLE_AFTER &&
+		    IDLE_SCAN*1000 > scan_ms) {
+			period = IDLE_SCAN*1000;
+			sstat.idle_scans++;
+		}
+		wait = period - tdiff > 0 ? period - tdiff : 0;
+		t = now_us();
+		for (i = 0; i < npend; i++) {
+			int left = REQ_WAIT - (int)((t - pend[i].since) / 1000);
+
+			if (left < wait)
+				wait = left > 0 ? left : 0;
+		}
+		if (poll(p, 1+np+nsubs+ntsubs, wait) > 0) {
+			int ns = nsubs;
+
+			for (i = ntsubs-1; i >= 0; i--) {
+				short ev = p[1+np+ns+i].revents;
+				char junk[64];
+				ssize_t n;
+
+				if (ev & POLLOUT && tsub_flush(i))
+					continue;
+				if (!(ev & ~POLLOUT))
+					continue;
+				n = recv(tsubs[i].fd, junk, sizeof(junk),
+					 MSG_DONTWAIT);
+				if (n == 0 || (n < 0 && errno != EAGAIN))
+					tsub_drop(i);
+			}
+			for (i = nsubs-1; i >= 0; i--) {
+				char junk[64];
+
+				if (p[1+np+i].revents &&
+				    read(subs[i], junk, sizeof(junk)) <= 0) {
+					close(subs[i]);
+					subs[i] = subs[--nsubs];
+				}
+			}
+		}
+		if (stopping) {
+			state_save();
+			exit(0);
+		}
+
+		/* Requests in, or given up on; subs may grow meanwhile */
+		t = now_us();
+		for (i = npend-1; i >= 0; i--) {
+			struct pend c = pend[i];
+
+			if (!p[1+i].revents &&
+			    t - c.since < REQ_WAIT*1000)
+				continue;
+			pend[i] = pend[--npend];
+			serve_client(c.fd, c.uid, &snaptime);
+			last_query = time(NULL);
+		}
+
+		if (p[0].revents&POLLIN) {
+			int clnt = accept(fd, NULL, NULL);
+			uid_t uid;
+
+			/* Our own uid and root, or everyone when run as root */
+			if (clnt >= 0 && (peer_uid(clnt, &uid) ||
+			    (getuid() && uid != getuid() && uid != 0))) {
+				sstat.rejected++;
+				close(clnt);
+				clnt = -1;
+			}
+			if (clnt >= 0 && npend == MAX_PEND) {
+				sstat.dropped++;
+				close(clnt);
+			} else if (clnt >= 0) {
+				pend[npend].fd = clnt;
+				pend[npend].uid = uid;
+				pend[npend].since = now_us();
+				npend++;
+			}
+		}
+		while (children && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			children--;
+			kid_done(pid);
+		}
+	}
+}
+
+/* Less jitter in the sample times, forked children drop SCHED_FIFO */
+static void sched_setup(void)
+{
+	if (conf.cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(conf.cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set))
+			perror("ifstat: sched_setaffinity");
+	}
+	if (conf.rtprio) {
+		struct sched_param sp;
+
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = conf.rtprio;
+		if (sched_setscheduler(0, SCHED_FIFO|SCHED_RESET_ON_FORK, &sp))
+			perror("ifstat: sched_setscheduler");
+	}
+}
+
+/*
+   Aggregator, -G [ADDR:]PORT. Daemons run with -U relay their table
+   after every scan; the aggregator keeps the latest one of each host
+   as a slice of agg_tab, one flat array for all hosts, and answers
+   ifstat2 -H queries with one pass over it: NAME or HOST/NAME
+   patterns, top-N by a rate, and with rollup the sum of each pattern
+   across hosts. One thread on epoll, run one per core with -A. A
+   connection is a relay when it starts with "relay ", else a request
+   as the daemon takes it, ended by EOF, answered by a forked child.
+   It listens on loopback unless given an address; with -K a relay's
+   hello has to carry the key.
+*/
+#define AGG_MAXREC 65536	/* interfaces of one host */
+#define AGG_MAXSTATS 65536	/* bytes of its stats */
+#define AGG_REQ 4096
+#define AGG_EVENTS 64
+
+struct agg_conn {
+	int fd;
+	int host;		/* -1 until it is a relay, -2 replaced */
+	char *buf;
+	size_t len, size;
+};
+
+struct agg_host {
+	char name[64];		/* empty when free */
+	int off, n;		/* slice of agg_tab */
+	struct agg_conn *conn;
+	char *stats;		/* of its last table */
+};
+
+static struct ifstat2_if *agg_tab;
+static int *agg_own;		/* host of each record */
+static int agg_n, agg_size;
+static struct agg_host *hosts;
+static int nhosts;
+static int agg_ep;
+
+/* Drop the host's slice, those after it move down */
+static void agg_cut(struct agg_host *h)
+{
+	int i, end = h->off + h->n;
+
+	memmove(agg_tab + h->off, agg_tab + end,
+		(agg_n - end) * sizeof(*agg_tab));
+	memmove(agg_own + h->off, agg_own + end,
+		(agg_n - end) * sizeof(*agg_own));
+	for (i = 0; i < nhosts; i++)
+		if (hosts[i].off > h->off)
+			hosts[i].off -= h->n;
+	agg_n -= h->n;
+	h->off = h->n = 0;
+}
+
+static void agg_store(int hi, struct ifstat2_if *r, int cnt)
+{
+	struct agg_host *h = &hosts[hi];
+	int i;
+
+	/* Same interfaces, the common case, is a copy in place */
+	if (h->n != cnt) {
+		agg_cut(h);
+		if (agg_n + cnt > agg_size) {
+			agg_size = (agg_n + cnt) * 2;
+			agg_tab = realloc(agg_tab, agg_size * sizeof(*agg_tab));
+			agg_own = realloc(agg_own, agg_size * sizeof(*agg_own));
+			if (!agg_tab || !agg_own)
+				abort();
+		}
+		h->off = agg_n;
+		h->n = cnt;
+		for (i = 0; i < cnt; i++)
+			agg_own[agg_n++] = hi;
+	}
+	memcpy(agg_tab + h->off, r, cnt * sizeof(*r));
+}
+
+/* Compared in full, whatever the first difference */
+static int agg_key_ok(const char *s)
+{
+	size_t i, n = strlen(conf.key);
+	int d = 0;
+
+	if (strlen(s) != n)
+		return 0;
+	for (i = 0; i < n; i++)
+		d |= s[i] ^ conf.key[i];
+	return !d;
 }
 
+/* A relay names its host, a reconnect takes over from the old one */
+static int agg_host(const char *name, struct agg_conn *c)
+{
+	int i, slot = -1;
+
+	for (i = 0; i < nhosts; i++) {
+		if (!strcmp(hosts[i].name, name)) {
+			if (hosts[i].conn)
+				hosts[i].conn->host = -2;
+			hosts[i].conn = c;
+			return i;
+		}
+		if (!hosts[i].name[0] && slot < 0)
+			slot = i;
+	}
+	if (slot < 0) {
+		if ((hosts = realloc(hosts, (nhosts+1) * sizeof(*hosts))) == NULL)
+			abort();
+		slot = nhosts++;
+	}
+	memset(&hosts[slot], 0, sizeof(*hosts));
+	strncpy(hosts[slot].name, name, sizeof(hosts[slot].name)-1);
+	hosts[slot].conn = c;
+	return slot;
+}
 
-static void dump_kern_db(FILE *fp)
+static void agg_consume(struct agg_conn *c, size_t len)
 {
-	struct ifstat_ent *n;
-
+	memmove(c->buf, c->buf + len, c->len - len);
+	c->len -= len;
+}
 
-	print_head(fp);
+/* Relay hello and tables, -1 on garbage or a wrong key */
+static int agg_parse(struct agg_conn *c)
+{
+	struct ifstat2_hdr *h;
+	size_t need;
+	char *nl, *key;
 
-	for (n=kern_db; n; n=n->next) {
-		if (!match(n->name))
-			continue;
-		print_one_if(fp, n);
+	if (c->host == -1) {
+		if (c->len < 6 || memcmp(c->buf, "relay ", 6))
+			return 0;
+		if ((nl = memchr(c->buf, '\n', c->len)) == NULL)
+			return 0;
+		*nl = 0;
+		if ((key = strchr(c->buf + 6, ' ')) != NULL)
+			*key++ = 0;
+		if (conf.key && (!key || !agg_key_ok(key)))
+			return -1;
+		c->host = agg_host(c->buf + 6, c);
+		agg_consume(c, nl + 1 - c->buf);
+	}
+	while (c->len >= sizeof(*h)) {
+		h = (struct ifstat2_hdr *)c->buf;
+		if (h->magic != IFSTAT2_MAGIC ||
+		    h->recsize != sizeof(struct ifstat2_if) ||
+		    h->count > AGG_MAXREC || h->stats_len > AGG_MAXSTATS)
+			return -1;
+		need = sizeof(*h) + h->count * sizeof(struct ifstat2_if) +
+			h->stats_len;
+		if (c->len < need) {
+			if (c->size < need) {
+				c->size = need;
+				if ((c->buf = realloc(c->buf, c->size)) == NULL)
+					abort();
+			}
+			return 0;
+		}
+		agg_store(c->host, (struct ifstat2_if *)(h + 1), h->count);
+		free(hosts[c->host].stats);
+		hosts[c->host].stats = strndup((char *)h + need - h->stats_len,
+					       h->stats_len);
+		agg_consume(c, need);
 	}
+	return 0;
 }
 
-static int children;
-
-void sigchild(int signo)
+/* In the child, the request is taken as the daemon takes it */
+static void agg_answer(FILE *fp, char *req)
 {
-}
+	struct matcher m, *pm;
+	struct ifstat_ent *n, *sums;
+	char *line, *save, name[64+1+72];
+	int i, j, p, nsum;
+
+	memset(&query, 0, sizeof(query));
+	query.sort_key = -1;
+	for (line = strtok_r(req, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save))
+		client_cmd(line);
+
+	/* Each host's, as @stat HOST/NAME */
+	if (query.stats) {
+		fprintf(fp, "#hosts=%d -- aggregator pid=%d\n", nhosts, getpid());
+		for (i = 0; i < nhosts; i++) {
+			if (!hosts[i].name[0] || !hosts[i].stats)
+				continue;
+			for (line = strtok_r(hosts[i].stats, "\n", &save); line;
+			     line = strtok_r(NULL, "\n", &save))
+				if (!strncmp(line, "@stat ", 6))
+					fprintf(fp, "@stat %s/%s\n",
+						hosts[i].name, line + 6);
+		}
+		return;
+	}
 
-static void update_db(int interval)
-{
-	struct ifstat_ent *n, *is_new, *ns;
+	memset(&m, 0, sizeof(m));
+	matcher_set(&m, query.patterns, query.npatterns);
+	nsum = query.npatterns ? query.npatterns : 1;
+	if ((sums = calloc(nsum, sizeof(*sums))) == NULL ||
+	    (pm = calloc(nsum, sizeof(*pm))) == NULL)
+		abort();
+	for (p = 0; p < query.npatterns; p++)
+		matcher_set(&pm[p], &query.patterns[p], 1);
+
+	for (i = 0; i < agg_n; i++) {
+		struct ifstat2_if *r = &agg_tab[i];
+
+		snprintf(name, sizeof(name), "%s/%s",
+			 hosts[agg_own[i]].name, r->name);
+		for (p = 0; query.rollup && p < nsum; p++) {
+			if (query.npatterns && !matcher_test(&pm[p], r->name) &&
+			    !matcher_test(&pm[p], name))
+				continue;
+			sums[p].members++;
+			sums[p].speed += r->speed;
+			for (j = 0; j < MAXS && j < IFSTAT2_NCOUNTERS; j++) {
+				sums[p].val[j] += r->val[j];
+				sums[p].rate[j] += r->rate[j];
+			}
+		}
+		if (query.rollup || (m.n && !matcher_test(&m, r->name) &&
+				     !matcher_test(&m, name)))
+			continue;
 
-	
-	n = kern_db;
-	kern_db = NULL;
+		if ((n = calloc(1, sizeof(*n))) == NULL ||
+		    (n->name = strdup(name)) == NULL)
+			abort();
+		n->ifindex = r->ifindex;
+		n->speed = r->speed;
+		n->duplex = r->duplex;
+		n->util[0] = r->util[0];
+		n->util[1] = r->util[1];
+		n->flags = r->flags & IFSTAT2_SAT ? IFE_SAT : 0;
+		for (j = 0; j < MAXS && j < IFSTAT2_NCOUNTERS; j++) {
+			n->val[j] = r->val[j];
+			n->rate[j] = r->rate[j];
+		}
+		n->next = kern_db;
+		kern_db = n;
+	}
 
-	load_info();
+	/* sum:PATTERN rows, utilization of the summed speeds */
+	for (p = nsum-1; query.rollup && p >= 0; p--) {
+		n = &sums[p];
+		snprintf(name, sizeof(name), "sum:%s",
+			 query.npatterns ? query.patterns[p] : "*");
+		n->name = strdup(name);
+		n->ifindex = n->members;
+		set_util(n);
+		n->next = kern_db;
+		kern_db = n;
+	}
+	if (query.sort_key >= 0)
+		sort_db(query.sort_key, query.topn, 0);
 
-	is_new = kern_db; 
-	kern_db = n;
+	fprintf(fp, "#hosts=%d interfaces=%d -- aggregator pid=%d\n",
+		nhosts, agg_n, getpid());
+	for (n = kern_db; n; n = n->next)
+		dump_raw_ent(fp, n);
+}
 
-	/* 
-	   Update current as template to detect any
-	   new or removed devs.
-	*/
-	for (ns = is_new; ns; ns = ns->next) {
+static void agg_close(struct agg_conn *c)
+{
+	if (c->host >= 0) {
+		agg_cut(&hosts[c->host]);
+		hosts[c->host].name[0] = 0;
+		hosts[c->host].conn = NULL;
+		free(hosts[c->host].stats);
+		hosts[c->host].stats = NULL;
+	}
+	/* Forked children share the file, close alone leaves it polled */
+	epoll_ctl(agg_ep, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->buf);
+	free(c);
+}
 
-		if(!conf.scan_interval) 
-			abort();
+static void agg_query(struct agg_conn *c)
+{
+	pid_t pid;
+	FILE *fp;
 
-		for (n = kern_db; n; n = n->next) {
-			if (ns->ifindex == n->ifindex) {
-				int i;
-
-				for (i = 0; i < MAXS; i++) { 
-					uint64_t diff;
-					double sample;
-					
-					/* Handle one overflow correctly */
-
-					if( ns->val[i] < n->val[i] ) {
-						diff = (0xFFFFFFFF - n->val[i]) + ns->val[i]; 
-						overflow++;
-					}
-					else 
-						diff = ns->val[i] - n->val[i];
-
-//					ns->ival[i] = n->ival[i]; /* For overflow check */
-//					ns->val[i]  = n->val[i];
-
-					if(interval <= conf.min_interval) {
-						ewma = -11;
-						ns->rate[i] = n->rate[i];
-						goto done;
-					}
-					
-					/* Calc rate */
-					
-					sample = (double)(diff*1000)/interval;
-
-                                        if (interval >= conf.scan_interval) {
-                                                ns->rate[i] =  n->rate[i]+ W*(sample-n->rate[i]);
-						ewma = 1;
-                                        } else if (interval >= conf.time_constant) {
-						ns->rate[i] = sample;
-						ewma = 2;
-					} else {
-						double w = W*(double)interval/conf.scan_interval;
-						ns->rate[i] = n->rate[i] + w*(sample-n->rate[i]);
-						ewma = 3;
-					}
-                                        
-				done:;
-				}
-				break;
-			}
-		}
+	if (children >= MAX_CHILDREN) {
+		sstat.dropped++;
+		return;
 	}
-
-	/* Remove old table */
-	while (kern_db) {
-		struct ifstat_ent *tmp = kern_db;
-		kern_db = kern_db->next;
-		free(tmp->name);
-		free(tmp);
-	};
-	kern_db = is_new; /* The most recent devs from rt_netlink */
+	if ((pid = fork()) != 0) {
+		if (pid > 0)
+			children++;
+		return;
+	}
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	fcntl(c->fd, F_SETFL, 0);
+	if (c->len == c->size &&
+	    (c->buf = realloc(c->buf, c->size + 1)) == NULL)
+		abort();
+	c->buf[c->len] = 0;
+	if ((fp = fdopen(c->fd, "w")) != NULL) {
+		agg_answer(fp, c->buf);
+		fclose(fp);
+	}
+	exit(0);
 }
 
-static int poll_client(int fd)
+static void agg_read(struct agg_conn *c)
 {
-	struct pollfd p;
-	char buf[128], *cmd, *pfx;
 	ssize_t n;
 
-	p.fd = fd;
-	p.events = POLLIN;
-
-	if (poll(&p, 1, 100) > 0
-	    && (p.revents&POLLIN)) {
-		n = read(fd, buf, sizeof(buf));
-		if(n > 0) {
-			buf[n] = 0;
-			pfx = "scan_interval=";
-			if((cmd = strstr(buf, pfx))) {
-				conf.scan_interval = atoi(cmd+strlen(pfx));
-				W = 1 - 1/exp(log(10)*(double)conf.scan_interval/conf.time_constant);
-			}
-			pfx = "time_constant=";
-			if((cmd = strstr(buf, pfx))) {
-				conf.time_constant = atoi(cmd+strlen(pfx));
-				W = 1 - 1/exp(log(10)*(double)conf.scan_interval/conf.time_constant);
+	for (;;) {
+		if (c->len == c->size) {
+			/* A request is one read of the daemon's */
+			if (c->host == -1 && c->size >= AGG_REQ) {
+				agg_close(c);
+				return;
 			}
-			return 0;
+			c->size = c->size ? c->size * 2 : AGG_REQ;
+			if ((c->buf = realloc(c->buf, c->size)) == NULL)
+				abort();
+		}
+		n = read(c->fd, c->buf + c->len, c->size - c->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+		if (n <= 0) {
+			if (c->host == -1)
+				agg_query(c);
+			agg_close(c);
+			return;
+		}
+		c->len += n;
+		if (c->host == -2)
+			c->len = 0;
+		else if (agg_parse(c)) {
+			agg_close(c);
+			return;
 		}
 	}
-	return -1;
 }
 
-#define T_DIFF(a,b) (((a).tv_sec-(b).tv_sec)*1000 + ((a).tv_usec-(b).tv_usec)/1000)
-
-static void server_loop(int fd)
+static void agg_server(void)
 {
-	struct timeval snaptime;
-	struct pollfd p;
-	
-	memset(&snaptime, 0, sizeof(snaptime));
-	
-	p.fd = fd;
-	p.events = p.revents = POLLIN;
+	struct sockaddr_storage ss;
+	struct epoll_event ev, evs[AGG_EVENTS];
+	socklen_t len;
+	int fd, one = 1;
 
-	load_info();
+	if (tcp_addr(conf.aggregate, &ss, &len)) {
+		fprintf(stderr, "ifstat: bad address %s\n", conf.aggregate);
+		exit(1);
+	}
+	if ((fd = socket(ss.ss_family,
+			 SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) < 0) {
+		perror("ifstat: socket");
+		exit(1);
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&ss, len) < 0) {
+		perror("ifstat: bind");
+		exit(1);
+	}
+	if (listen(fd, 128) < 0) {
+		perror("ifstat: listen");
+		exit(1);
+	}
+	if (!conf.foreground && fork())
+		exit(0);
+	sched_setup();
 
-	for (;;) {
-		int status;
-		int tdiff;
-		struct timeval now;
+	chdir("/");
+	if (!conf.foreground) {
+		close(0); close(1); close(2);
+		setsid();
+	}
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGCHLD, sigchild);
 
-		gettimeofday(&now, NULL);
-		tdiff = T_DIFF(now, snaptime);
+	if ((agg_ep = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("ifstat: epoll_create");
+		exit(1);
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(agg_ep, EPOLL_CTL_ADD, fd, &ev);
 
-//		if (tdiff >= 0) { 
-			update_db(tdiff);
-			snaptime = now;
-			tdiff = 0;
-//		}
-		if (poll(&p, 1, conf.scan_interval-tdiff) > 0
-		    && (p.revents&POLLIN)) {
-			int clnt = accept(fd, NULL, NULL);
+	for (;;) {
+		int i, n, clnt, status;
 
-			if (clnt >= 0) {
-				pid_t pid;
-
-				/*
-				  We assume forking will be ok
-				  so update database here not
-				  have races with forked process
-				*/
-
-				gettimeofday(&now, NULL);
-				tdiff = T_DIFF(now, snaptime);
-//				if (tdiff >= min_interval) {
-					update_db(tdiff);
-					snaptime = now;
-					tdiff = 0;
-//				}
-				poll_client(clnt);
-				
-				sprintf(info_source,
-					"pid=%d sampling_interval=%d "
-					"time_const=%d",
-					getpid(),
-					conf.scan_interval/1000,
-					conf.time_constant/1000);
-
-				if (children >= 5) {
-					close(clnt);
-				} else if ((pid = fork()) != 0) {
-
-					if (pid>0) 
-						children++;
-					close(clnt);
-				} else {
-					FILE *fp = fdopen(clnt, "w");
-					if (fp) {
-						/* Write on clients socket */
-						dump_raw_db(fp);
-					}
-					exit(0);
-				}
+		n = epoll_wait(agg_ep, evs, AGG_EVENTS, -1);
+		for (i = 0; i < n; i++) {
+			struct agg_conn *c = evs[i].data.ptr;
+
+			if (c) {
+				agg_read(c);
+				continue;
+			}
+			while ((clnt = accept4(fd, NULL, NULL,
+					       SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+				if ((c = calloc(1, sizeof(*c))) == NULL)
+					abort();
+				c->fd = clnt;
+				c->host = -1;
+				ev.events = EPOLLIN;
+				ev.data.ptr = c;
+				epoll_ctl(agg_ep, EPOLL_CTL_ADD, clnt, &ev);
 			}
 		}
 		while (children && waitpid(-1, &status, WNOHANG) > 0)
@@ -640,16 +5730,95 @@ static void server_loop(int fd)
 	}
 }
 
-int verify_forging(int fd)
+/*
+   One shot, -1 MS. Two samples taken in-process MS apart and the exact
+   rates between them, without starting or asking a daemon. The first
+   sample is a full dump, or when every PATTERN is a plain name one
+   RTM_GETLINK per name; the second reads only the interfaces that
+   matched, by ifindex. Link speeds are queried while waiting.
+*/
+static void oneshot(void)
 {
-	struct ucred cred;
-	unsigned int olen = sizeof(cred);
-	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, (void*)&cred, &olen) ||
-	    olen < sizeof(cred))
-		return -1;
-	if (cred.uid == getuid() || cred.uid == 0)
-		return 0;
-	return -1;
+	struct ifstat_ent *first, *n, *o, *db = NULL;
+	struct timespec t;
+	int i, names = npatterns > 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	scan_query = 1;
+	for (i = 0; i < npatterns; i++)
+		if (pmatch.pat[i].kind != PAT_NAME)
+			names = 0;
+
+	if ((watch.idx = realloc(watch.idx, (npatterns+1) * sizeof(int))) == NULL)
+		abort();
+	watch.nidx = 0;
+	if (names) {
+		for (i = 0; i < npatterns; i++)
+			if ((watch.idx[watch.nidx] = if_nametoindex(patterns[i])))
+				watch.nidx++;
+		if (load_netlink_targeted() < 0)
+			goto nl_err;
+	} else if (load_netlink() < 0)
+		goto nl_err;
+
+	/* The second sample is of the first's matches only */
+	first = kern_db;
+	kern_db = NULL;
+	watch.nidx = 0;
+	for (n = first; n; n = n->next) {
+		if (!match_ent(n))
+			continue;
+		if ((watch.idx = realloc(watch.idx, (watch.nidx+1) * sizeof(int))) == NULL)
+			abort();
+		watch.idx[watch.nidx++] = n->ifindex;
+		if (conf.util)
+			speed_query(n);
+	}
+	hash_db(first);
+
+	t.tv_sec += conf.oneshot / 1000;
+	t.tv_nsec += (conf.oneshot % 1000) * 1000000L;
+	if (t.tv_nsec >= 1000000000L) {
+		t.tv_sec++;
+		t.tv_nsec -= 1000000000L;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+		;
+	if (load_netlink_targeted() < 0)
+		goto nl_err;
+
+	/* Exact rates over the kernel's sample times */
+	while ((n = kern_db) != NULL) {
+		kern_db = n->next;
+		if ((o = idx_lookup(n->ifindex)) == NULL || n->stamp <= o->stamp) {
+			free_ent(n);
+			continue;
+		}
+		/* A counter that went back was reset, no rate */
+		for (i = 0; i < MAXS; i++)
+			n->rate[i] = n->val[i] < o->val[i] ? 0 :
+				(double)(n->val[i] - o->val[i]) * 1e6 /
+				(n->stamp - o->stamp);
+		n->speed = o->speed;
+		n->duplex = o->duplex;
+		set_util(n);
+		n->next = db;
+		db = n;
+	}
+	free_db(first);
+
+	/* Collectors prepend, back to kernel or PATTERN order */
+	kern_db = NULL;
+	for (; db; db = n) {
+		n = db->next;
+		db->next = kern_db;
+		kern_db = db;
+	}
+	return;
+
+nl_err:
+	fprintf(stderr, "ifstat: rtnetlink unavailable\n");
+	exit(1);
 }
 
 static void usage(void) __attribute__((noreturn));
@@ -657,7 +5826,7 @@ static void usage(void) __attribute__((noreturn));
 static void usage(void)
 {
         fprintf(stderr,
-"Usage: ifstat2 [ -h?vVzrnasd:t: ] [ PATTERN [ PATTERN ] ]\n"
+"Usage: ifstat2 [ -h?vVfienSrwcqQupd:t:s:N:g:x:X:b:l:P:B:A:R:L:T:U:G:K:H:1: ] [ PATTERN [ PATTERN ] ]\n"
                 );
 
         fprintf(stderr, " client options:\n");
@@ -666,44 +5835,73 @@ static void usage(void)
         fprintf(stderr, "  -v print version\n");
         fprintf(stderr, "  -i verbose info\n");
         fprintf(stderr, "  -n disable formatting of output\n");
+        fprintf(stderr, "  -S print daemon statistics\n");
+        fprintf(stderr, "  -s COUNTER -- sort by rate of COUNTER, e.g. rx_bits tx_pps rx_dropped\n");
+        fprintf(stderr, "  -N NUM -- only show the NUM top interfaces\n");
+        fprintf(stderr, "  -r show rollups: m:MASTER p:PARENT g:GROUP c:CONTAINER\n");
+        fprintf(stderr, "  -w watch rule events\n");
+        fprintf(stderr, "  -c per-CPU softnet statistics\n");
+        fprintf(stderr, "  -q per-queue IRQ rates by CPU\n");
+        fprintf(stderr, "  -Q qdisc and class statistics\n");
+        fprintf(stderr, "  -p protocol counters from /proc/net/snmp, snmp6 and netstat\n");
+        fprintf(stderr, "  -u show rx/tx utilization of link speed, sort with -s rx_util\n");
+        fprintf(stderr, "  -P NAME -- estimator profile, set up by -d and -t on first use\n");
+        fprintf(stderr, "  -B TOKEN -- counters and average rates since the last query with TOKEN\n");
+        fprintf(stderr, "  -T FROM[,TO] -- average and max rates from the -L log, unix times or\n"
+                        "     seconds before now when negative, e.g. -T -3600\n");
+        fprintf(stderr, "  -1 MS -- exact rates over MS ms from two samples, without the daemon\n");
+        fprintf(stderr, "  -H [ADDR:]PORT -- query all hosts at the aggregator, -r sums each PATTERN\n");
         fprintf(stderr, "  -h this help\n");
 
         fprintf(stderr, " daemon options;\n");
         fprintf(stderr, "  -d SECS -- scan interval in SECS seconds and daemonize\n");
         fprintf(stderr, "  -t SECS -- time constant for average calc [60] (t>d)\n");
+        fprintf(stderr, "  -g NAME=PATTERN[,PATTERN] -- rollup group, repeatable\n");
+        fprintf(stderr, "  -x RULE -- e.g. \"rx_dropped rate > 100/s for 3 scans on eth*\"\n");
+        fprintf(stderr, "  -X CMD -- run CMD when a rule fires or clears\n");
+        fprintf(stderr, "  -b netlink|proc -- collector, proc reads /proc/net/dev\n");
+        fprintf(stderr, "  -l MBIT -- speed of links that report none, e.g. veth\n");
+        fprintf(stderr, "  -A CPU -- pin the daemon to CPU\n");
+        fprintf(stderr, "  -R PRIO -- sample with SCHED_FIFO priority PRIO\n");
+        fprintf(stderr, "  -L DIR -- log samples to segment files in DIR\n");
+        fprintf(stderr, "  -U [ADDR:]PORT[,NAME] -- relay every scan to the aggregator as NAME\n"
+                        "     [hostname]\n");
+        fprintf(stderr, "  -K FILE -- key the aggregator asks relays for, first line of FILE\n");
+        fprintf(stderr, " aggregator options;\n");
+        fprintf(stderr, "  -G [ADDR:]PORT -- aggregate relaying daemons on ADDR [127.0.0.1],\n"
+                        "     -f -A -K apply\n");
 
         exit(-1);
 }
 
+/* Shared with libifstat2 */
 int connect_server() 
 {
-	int fd;
-	struct sockaddr_un sun;
-
-	/* Setup for abstract unix socket */
+	int fd = ifstat2_connect();
 
-	memset(&sun, 0, sizeof(sun));
-	sun.sun_family = AF_UNIX;
-	sun.sun_path[0] = 0;
-	sprintf(sun.sun_path+1, "ifstat%dv" VERSION, getuid());
+	if (fd < 0 && errno == EPERM) {
+		printf("Forged server!\n");
+		exit(1);
+	}
+	return fd;
+}
 
-	if((fd = socket(AF_UNIX, SOCK_STREAM, 0))==-1)
-		return -1;
-	
-	if(connect(fd, (struct sockaddr*)&sun, sizeof(sun))) {
-		strcpy(sun.sun_path+1, "ifstat0");
-		if(connect(fd, (struct sockaddr*)&sun, sizeof(sun))) {
-			close(fd);
-			return -1;
-		}
+/* Blocking, for ifstat2 -H */
+int connect_hub()
+{
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int fd;
 
+	if (tcp_addr(conf.hub, &ss, &len)) {
+		fprintf(stderr, "ifstat: bad address %s\n", conf.hub);
+		exit(1);
 	}
-	if(verify_forging(fd)) {
-		printf("Forged server!\n");
-		close(fd);
+	if ((fd = socket(ss.ss_family, SOCK_STREAM, 0)) < 0 ||
+	    connect(fd, (struct sockaddr *)&ss, len)) {
+		perror("ifstat: connect");
 		exit(1);
 	}
-	
 	return fd;
 }
 
@@ -750,7 +5948,8 @@ int server()
 	
 	conf.time_constant *= 1000;
 	conf.scan_interval *= 1000; 
-	W = 1 - 1/exp(log(10)*(double)conf.scan_interval/conf.time_constant);
+	est_resolution();
+	sched_setup();
 	
 	chdir("/");
 	if(!conf.foreground) {
@@ -759,26 +5958,75 @@ int server()
 	}
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGCHLD, sigchild);
+	signal(SIGTERM, sigstop);
+	signal(SIGINT, sigstop);
 	server_loop(fd);
 	exit(0);
 }
 
-int push_config(int fd)
+/* Appends to buf, a full buf leaves *len at size */
+static void cfg_add(char *buf, size_t size, size_t *len, const char *fmt, ...)
 {
-	char buf[256], *p;
+	va_list ap;
 	int n;
 
-	p = buf;
-	*p = 0;
-	if(conf.time_constant) {
-		n = sprintf(p, "time_constant=%d\n", conf.time_constant*1000);
-		p+=n;
+	if (*len >= size)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(buf + *len, size - *len, fmt, ap);
+	va_end(ap);
+	*len = n < 0 || n >= size - *len ? size : *len + n;
+}
+
+/*
+   The request, which the daemon takes in one read of 4096 bytes. The
+   settings go last but are sized first; patterns get what is left,
+   and sort/top only go when all of them did.
+*/
+int push_config(int fd)
+{
+	char buf[4096], tail[512], sel[64] = "";
+	size_t len = 0, tlen = 0;
+	int i, pushed;
+
+	if(conf.rollup)
+		cfg_add(tail, sizeof(tail), &tlen, "rollup\n");
+	for (i = 0; i < NFAMILIES; i++)
+		if (families[i].wanted)
+			cfg_add(tail, sizeof(tail), &tlen, "family=%s\n",
+				families[i].tag);
+	if (family_find("irq")->wanted)
+		cfg_add(tail, sizeof(tail), &tlen, "links\n");
+	if(conf.profile)
+		cfg_add(tail, sizeof(tail), &tlen, "profile=%.31s\n", conf.profile);
+	if(conf.token)
+		cfg_add(tail, sizeof(tail), &tlen, "baseline=%.31s\n", conf.token);
+	if(conf.time_constant)
+		cfg_add(tail, sizeof(tail), &tlen, "time_constant=%d\n",
+			conf.time_constant*1000);
+	if(conf.scan_interval)
+		cfg_add(tail, sizeof(tail), &tlen, "scan_interval=%d\n",
+			conf.scan_interval*1000);
+	if (tlen >= sizeof(tail)) {
+		fprintf(stderr, "ifstat: request too long\n");
+		return -1;
 	}
-	if(conf.scan_interval) {
-		n = sprintf(p, "scan_interval=%d\n", conf.scan_interval*1000);
-		p+=n;
+
+	for (pushed = 0; pushed < npatterns && pushed < MAX_QPAT; pushed++) {
+		if (len + strlen(patterns[pushed]) + 7 + sizeof(sel) + tlen >=
+		    sizeof(buf))
+			break;
+		cfg_add(buf, sizeof(buf), &len, "match=%s\n", patterns[pushed]);
 	}
-	write(fd, buf, strlen(buf));
+
+	/* Selection is pushed down, the daemon filters the same set */
+	if(conf.sort_key >= 0 && pushed == npatterns)
+		snprintf(sel, sizeof(sel), "sort=%d\ntop=%d\n",
+			 conf.sort_key, conf.topn);
+	cfg_add(buf, sizeof(buf), &len, "%s%s", sel, tail);
+	if(len == 0)
+		cfg_add(buf, sizeof(buf), &len, "nop\n");
+	write(fd, buf, len);
 	return 0;
 }
 
@@ -786,10 +6034,14 @@ int main(int argc, char *argv[])
 {
 	int ch;
 	int fd;
+	int stats = 0;
+	int events = 0;
 
 	conf.min_interval = 20;
+	conf.cpu = -1;
+	conf.sort_key = -1;
 	
-	while ((ch = getopt(argc, argv, "h?vVfid:t:ern")) != EOF) {
+	while ((ch = getopt(argc, argv, "h?vVfid:t:ernSs:N:g:wx:X:b:cqQul:pP:B:A:R:L:T:U:G:K:H:1:")) != EOF) {
 		switch(ch) {
 
 		case 'n':
@@ -798,6 +6050,150 @@ int main(int argc, char *argv[])
 		case 'e':
 			conf.show_errors = 1;
 			break;
+		case 'S':
+			stats = 1;
+			break;
+		case 'r':
+			conf.rollup = 1;
+			break;
+		case 'w':
+			events = 1;
+			break;
+		case 'c':
+			family_find("softnet")->wanted = 1;
+			break;
+		case 'q':
+			family_find("irq")->wanted = 1;
+			break;
+		case 'Q':
+			family_find("qdisc")->wanted = 1;
+			break;
+		case 'u':
+			conf.util = 1;
+			break;
+		case 'P':
+			conf.profile = optarg;
+			break;
+		case 'B':
+			conf.token = optarg;
+			break;
+		case 'L':
+			/* The daemon runs in / */
+			if ((conf.logdir = realpath(optarg, NULL)) == NULL) {
+				perror("ifstat: log directory");
+				exit(1);
+			}
+			break;
+		case 'T': {
+			time_t now = time(NULL);
+			long long from, to = 0;
+
+			if (sscanf(optarg, "%lld,%lld", &from, &to) < 1) {
+				fprintf(stderr, "ifstat: invalid range\n");
+				exit(1);
+			}
+			conf.from = from > 0 ? from : now + from;
+			conf.to = to > 0 ? to : now + to;
+			if (conf.from >= conf.to) {
+				fprintf(stderr, "ifstat: empty range\n");
+				exit(1);
+			}
+			break;
+		}
+		case 'U': {
+			char *p;
+
+			conf.relay = optarg;
+			if ((p = strchr(optarg, ',')) != NULL) {
+				*p++ = 0;
+				conf.relay_name = p;
+			}
+			if (tcp_addr(optarg, &relay.addr, &relay.alen) ||
+			    (p && (!*p || strpbrk(p, " /\n")))) {
+				fprintf(stderr, "ifstat: bad address %s\n", optarg);
+				exit(1);
+			}
+			break;
+		}
+		case 'G':
+			conf.aggregate = optarg;
+			break;
+		case 'K':
+			read_key(optarg);
+			break;
+		case 'H':
+			conf.hub = optarg;
+			break;
+		case '1':
+			if (sscanf(optarg, "%d", &conf.oneshot) != 1 ||
+			    conf.oneshot <= 0) {
+				fprintf(stderr, "ifstat: bad interval %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'p':
+			family_find("snmp")->wanted = 1;
+			family_find("snmp6")->wanted = 1;
+			family_find("netstat")->wanted = 1;
+			break;
+		case 'A':
+			if (sscanf(optarg, "%d", &conf.cpu) != 1 ||
+			    conf.cpu < 0 || conf.cpu >= CPU_SETSIZE) {
+				fprintf(stderr, "ifstat: invalid cpu\n");
+				exit(1);
+			}
+			break;
+		case 'R':
+			if (sscanf(optarg, "%d", &conf.rtprio) != 1 ||
+			    conf.rtprio < sched_get_priority_min(SCHED_FIFO) ||
+			    conf.rtprio > sched_get_priority_max(SCHED_FIFO)) {
+				fprintf(stderr, "ifstat: invalid priority\n");
+				exit(1);
+			}
+			break;
+		case 'l':
+			if (sscanf(optarg, "%d", &conf.nominal) != 1 ||
+			    conf.nominal < 0) {
+				fprintf(stderr, "ifstat: invalid nominal speed\n");
+				exit(1);
+			}
+			break;
+		case 'x':
+			if (add_rule(optarg)) {
+				fprintf(stderr, "ifstat: invalid rule %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'X':
+			hook_cmd = optarg;
+			break;
+		case 'b':
+			if (!strcmp(optarg, "netlink"))
+				conf.backend = BK_NETLINK;
+			else if (!strcmp(optarg, "proc"))
+				conf.backend = BK_PROCDEV;
+			else
+				usage();
+			break;
+		case 'g':
+			if (add_group(optarg)) {
+				fprintf(stderr, "ifstat: invalid group %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 's':
+			if ((conf.sort_key = counter_index(optarg)) < 0) {
+				fprintf(stderr, "ifstat: unknown counter %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'N':
+			if (sscanf(optarg, "%d", &conf.topn) != 1 ||
+			    conf.topn <= 0) {
+				fprintf(stderr, "ifstat: invalid top count\n");
+				exit(1);
+			}
+			break;
 		case 'f':
 			conf.foreground = 1;
 			break;
@@ -832,19 +6228,58 @@ int main(int argc, char *argv[])
 
 	/* Client section */
 
-	patterns = argv;
-	npatterns = argc;
+	if (conf.topn && conf.sort_key < 0)
+		conf.sort_key = counter_index("rx_bytes");
+
+	set_patterns(argv, argc);
+
+	if (conf.aggregate)
+		agg_server();
+
+	if (conf.oneshot) {
+		oneshot();
+		if (conf.sort_key >= 0)
+			sort_db(conf.sort_key, conf.topn, 1);
+		dump_kern_db(stdout);
+		exit(0);
+	}
+
+	/* From the log, no daemon needed */
+	if (conf.to) {
+		if (!conf.logdir) {
+			fprintf(stderr, "ifstat: -T needs -L DIR\n");
+			exit(1);
+		}
+		conf.show_errors = conf.util = 0;
+		load_history();
+		print_history(stdout);
+		exit(0);
+	}
 
 	while(1) {
-		fd = connect_server();
+		fd = conf.hub ? connect_hub() : connect_server();
 		if(fd >= 0) {
 			FILE *sfp;
 		
-			if( conf.time_constant || conf.scan_interval) {
-				push_config(fd);
-			} else {
-				write(fd, "nop\n", 4);
+			if (events) {
+				char buf[512];
+				ssize_t n;
+
+				write(fd, "events\n", 7);
+				while ((n = read(fd, buf, sizeof(buf))) > 0) {
+					fwrite(buf, 1, n, stdout);
+					fflush(stdout);
+				}
+				exit(0);
 			}
+			if (stats) {
+				write(fd, "stats\n", 6);
+			} else if (push_config(fd)) {
+				exit(1);
+			}
+			/* The aggregator takes the request up to EOF */
+			if (conf.hub)
+				shutdown(fd, SHUT_WR);
 
 			sfp = fdopen(fd, "r");
 			
@@ -853,6 +6288,31 @@ int main(int argc, char *argv[])
 			if(sfp) {
 				load_raw_table(sfp);
 				fclose(sfp);
+				/* Names are HOST/NAME, already matched */
+				if (conf.hub)
+					set_patterns(NULL, 0);
+				if (stats) {
+					print_stats(stdout);
+					exit(0);
+				}
+				if (family_find("softnet")->wanted) {
+					print_softnet(stdout);
+					exit(0);
+				}
+				if (family_find("irq")->wanted) {
+					print_irq(stdout);
+					exit(0);
+				}
+				if (family_find("qdisc")->wanted) {
+					print_qdisc(stdout);
+					exit(0);
+				}
+				if (family_find("snmp")->wanted) {
+					print_snmp(stdout);
+					exit(0);
+				}
+				if (conf.sort_key >= 0)
+					sort_db(conf.sort_key, conf.topn, 1);
 				dump_kern_db(stdout);
 			}
 			exit(0);
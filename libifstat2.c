@@ -0,0 +1,212 @@
+/*
+ * libifstat2.c	in-process queries to the ifstat2 daemon
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * The request is the text ifstat2 sends, the reply a binary table:
+ * no fork, exec or formatting on either side.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libifstat2.h"
+
+/* Daemons, relays and clients of any word size share the layout */
+_Static_assert(sizeof(struct ifstat2_hdr) == 32, "ifstat2_hdr layout");
+_Static_assert(sizeof(struct ifstat2_if) % 8 == 0, "ifstat2_if layout");
+
+/* The server must be our own or root's */
+static int verify_forging(int fd)
+{
+	struct ucred cred;
+	socklen_t olen = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, (void*)&cred, &olen) ||
+	    olen < sizeof(cred))
+		return -1;
+	if (cred.uid == getuid() || cred.uid == 0)
+		return 0;
+	return -1;
+}
+
+int ifstat2_connect(void)
+{
+	int fd;
+	struct sockaddr_un sun;
+
+	/* Setup for abstract unix socket */
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	sprintf(sun.sun_path+1, "ifstat%dv" IFSTAT2_VERSION, getuid());
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr*)&sun, sizeof(sun))) {
+		/* The system daemon, run by root. The abstract name is
+		   all of sun_path, clear what is left of ours */
+		memset(sun.sun_path, 0, sizeof(sun.sun_path));
+		sprintf(sun.sun_path+1, "ifstat0v" IFSTAT2_VERSION);
+		if (connect(fd, (struct sockaddr*)&sun, sizeof(sun))) {
+			close(fd);
+			return -1;
+		}
+	}
+	if (verify_forging(fd)) {
+		close(fd);
+		errno = EPERM;
+		return -1;
+	}
+	return fd;
+}
+
+static int send_query(int fd, const struct ifstat2_query *q, int subscribe)
+{
+	char buf[4096], *p = buf, *end = buf + sizeof(buf) - 64;
+	ssize_t n;
+	int i;
+
+	p += sprintf(p, "binary\n");
+	if (subscribe)
+		p += sprintf(p, "subscribe\n");
+	if (q) {
+		for (i = 0; i < q->npatterns; i++) {
+			if (strlen(q->patterns[i]) + 8 > end - p) {
+				errno = E2BIG;
+				return -1;
+			}
+			p += sprintf(p, "match=%s\n", q->patterns[i]);
+		}
+		if (q->rollup)
+			p += sprintf(p, "rollup\n");
+		if (q->sort)
+			p += sprintf(p, "sort=%.31s\ntop=%d\n", q->sort, q->topn);
+		if (q->profile)
+			p += sprintf(p, "profile=%.31s\n", q->profile);
+		if (q->baseline)
+			p += sprintf(p, "baseline=%.31s\n", q->baseline);
+		if (q->stats && q->stats_size > 0 && !subscribe)
+			p += sprintf(p, "stats\n");
+	}
+
+	/* The daemon takes the request in one read */
+	n = write(fd, buf, p - buf);
+	if (n != p - buf) {
+		if (n >= 0)
+			errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = ECONNRESET;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Stats text after the records, what does not fit in stats is read past */
+static int read_table(int fd, struct ifstat2_if *buf, int max,
+		      int64_t *baseline_ms, char *stats, int stats_size)
+{
+	struct ifstat2_hdr h;
+	struct ifstat2_if skip;
+	uint32_t left, n, k;
+	int i;
+
+	if (read_all(fd, &h, sizeof(h)))
+		return -1;
+	if (h.magic != IFSTAT2_MAGIC || h.recsize != sizeof(*buf)) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (baseline_ms)
+		*baseline_ms = h.baseline_ms;
+	for (i = 0; i < h.count; i++)
+		if (read_all(fd, i < max ? &buf[i] : &skip, sizeof(*buf)))
+			return -1;
+	if (stats && stats_size > 0)
+		stats[0] = 0;
+	for (left = h.stats_len, i = 0; left; left -= n) {
+		n = left < sizeof(skip) ? left : sizeof(skip);
+
+		if (read_all(fd, &skip, n))
+			return -1;
+		if (!stats || stats_size <= 0)
+			continue;
+		k = stats_size - 1 - i < n ? stats_size - 1 - i : n;
+		memcpy(stats + i, &skip, k);
+		i += k;
+		stats[i] = 0;
+	}
+	return h.count;
+}
+
+int ifstat2_query(const struct ifstat2_query *q, struct ifstat2_if *buf,
+		  int max)
+{
+	int fd, n, err;
+
+	if ((fd = ifstat2_connect()) < 0)
+		return -1;
+	if (send_query(fd, q, 0))
+		n = -1;
+	else
+		n = read_table(fd, buf, max, q ? q->baseline_ms : NULL,
+			       q ? q->stats : NULL, q ? q->stats_size : 0);
+	err = errno;
+	close(fd);
+	errno = err;
+	return n;
+}
+
+int ifstat2_subscribe(const struct ifstat2_query *q)
+{
+	int fd;
+
+	if ((fd = ifstat2_connect()) < 0)
+		return -1;
+	if (send_query(fd, q, 1)) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+int ifstat2_next(int h, struct ifstat2_if *buf, int max)
+{
+	return read_table(h, buf, max, NULL, NULL, 0);
+}
+
+void ifstat2_close(int h)
+{
+	close(h);
+}
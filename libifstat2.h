@@ -0,0 +1,84 @@
+/*
+ * libifstat2.h	in-process queries to the ifstat2 daemon
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __LIBIFSTAT2_H__
+#define __LIBIFSTAT2_H__ 1
+
+#include <stdint.h>
+
+/* Daemons of other versions listen on another socket */
+#define IFSTAT2_VERSION "0.33"
+
+/* val[] and rate[] are in struct ifstats64 order, see stats64.h */
+#define IFSTAT2_NCOUNTERS 23
+
+#define IFSTAT2_SAT	1	/* utilization at or above 90% */
+
+struct ifstat2_if {
+	int32_t		ifindex;
+	uint32_t	flags;
+	char		name[72];	/* rollups are m:, p:, g: or c:NAME */
+	int32_t		speed;		/* Mbit/s, 0 unknown */
+	int32_t		duplex;
+	double		util[2];	/* rx, tx % of speed */
+	uint64_t	val[IFSTAT2_NCOUNTERS];
+	double		rate[IFSTAT2_NCOUNTERS];	/* per second */
+};
+
+/* On the socket a table is this header and count records */
+#define IFSTAT2_MAGIC	0x69663274
+
+/* 32 bytes on every ABI, i386 aligns int64_t to 4 inside structs */
+struct ifstat2_hdr {
+	uint32_t	magic;
+	uint32_t	recsize;	/* sizeof(struct ifstat2_if) */
+	uint32_t	count;
+	uint32_t	interval;	/* daemon sampling, ms */
+	uint32_t	stats_len;	/* "@stat" text after the records */
+	uint32_t	pad;
+	int64_t		baseline_ms;	/* age of the baseline, -1 new, 0 none */
+};
+
+/* All optional, zeroed is every interface in kernel order */
+struct ifstat2_query {
+	const char	**patterns;	/* globs, as ifstat2 PATTERN */
+	int		npatterns;
+	const char	*sort;		/* counter or alias, e.g. "rx_bits" */
+	int		topn;		/* with sort */
+	int		rollup;
+	const char	*profile;	/* estimator profile, as -P */
+	const char	*baseline;	/* token, as -B */
+	int64_t		*baseline_ms;	/* out, age of it, -1 new */
+	char		*stats;		/* out, the daemon's "@stat NAME VALUE"
+					   lines as ifstat2 -S gets them */
+	int		stats_size;
+};
+
+/* Connected socket to our own daemon, else root's; -1 and errno */
+int ifstat2_connect(void);
+
+/*
+   One table. Up to max interfaces are stored in buf, the number the
+   daemon sent is returned, or -1 and errno.
+*/
+int ifstat2_query(const struct ifstat2_query *q, struct ifstat2_if *buf,
+		  int max);
+
+/*
+   A table after every scan of the daemon. ifstat2_subscribe returns
+   the handle, ifstat2_next blocks for the next table and returns as
+   ifstat2_query. While one is still going out to a subscriber that
+   does not keep up, the next scan's is skipped.
+   Sorting, baselines and stats do not apply.
+*/
+int ifstat2_subscribe(const struct ifstat2_query *q);
+int ifstat2_next(int h, struct ifstat2_if *buf, int max);
+void ifstat2_close(int h);
+
+#endif /* __LIBIFSTAT2_H__ */
@@ -25,6 +25,18 @@
 
 #include "libnetlink.h"
 
+/*
+   Dump replies are filled as the request is sent and then at the end
+   of each recvmsg, for the next batch; single replies as sent.
+*/
+static __u64 rtnl_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
 void rtnl_close(struct rtnl_handle *rth)
 {
 	close(rth->fd);
@@ -34,7 +46,7 @@ int rtnl_open(struct rtnl_handle *rth, unsigned subscriptions)
 {
 	unsigned int addr_len;
 
-	memset(rth, 0, sizeof(rth));
+	memset(rth, 0, sizeof(*rth));
 
 	rth->fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
 	if (rth->fd < 0) {
@@ -74,6 +86,7 @@ int rtnl_wilddump_request(struct rtnl_handle *rth, int family, int type)
 		struct rtgenmsg g;
 	} req;
 	struct sockaddr_nl nladdr;
+	int status;
 
 	memset(&nladdr, 0, sizeof(nladdr));
 	nladdr.nl_family = AF_NETLINK;
@@ -85,7 +98,9 @@ int rtnl_wilddump_request(struct rtnl_handle *rth, int family, int type)
 	req.nlh.nlmsg_seq = rth->dump = ++rth->seq;
 	req.g.rtgen_family = family;
 
-	return sendto(rth->fd, (void*)&req, sizeof(req), 0, (struct sockaddr*)&nladdr, sizeof(nladdr));
+	status = sendto(rth->fd, (void*)&req, sizeof(req), 0, (struct sockaddr*)&nladdr, sizeof(nladdr));
+	rth->stamp = rtnl_now();
+	return status;
 }
 
 int rtnl_send(struct rtnl_handle *rth, char *buf, int len)
@@ -103,6 +118,7 @@ int rtnl_dump_request(struct rtnl_handle *rth, int type, void *req, int len)
 	struct nlmsghdr nlh;
 	struct sockaddr_nl nladdr;
 	struct iovec iov[2] = { { &nlh, sizeof(nlh) }, { req, len } };
+	int status;
 	struct msghdr msg = {
 		(void*)&nladdr, sizeof(nladdr),
 		iov,	2,
@@ -119,7 +135,9 @@ int rtnl_dump_request(struct rtnl_handle *rth, int type, void *req, int len)
 	nlh.nlmsg_pid = 0;
 	nlh.nlmsg_seq = rth->dump = ++rth->seq;
 
-	return sendmsg(rth->fd, &msg, 0);
+	status = sendmsg(rth->fd, &msg, 0);
+	rth->stamp = rtnl_now();
+	return status;
 }
 
 int rtnl_dump_filter(struct rtnl_handle *rth,
@@ -135,6 +153,7 @@ int rtnl_dump_filter(struct rtnl_handle *rth,
 	while (1) {
 		int status;
 		struct nlmsghdr *h;
+		__u64 next;
 
 		struct msghdr msg = {
 			(void*)&nladdr, sizeof(nladdr),
@@ -144,6 +163,7 @@ int rtnl_dump_filter(struct rtnl_handle *rth,
 		};
 
 		status = recvmsg(rth->fd, &msg, 0);
+		next = rtnl_now();
 
 		if (status < 0) {
 			if (errno == EINTR)
@@ -159,11 +179,15 @@ int rtnl_dump_filter(struct rtnl_handle *rth,
 			fprintf(stderr, "sender address length == %d\n", msg.msg_namelen);
 			exit(1);
 		}
+		rth->recvs++;
+		rth->bytes += status;
 
 		h = (struct nlmsghdr*)buf;
 		while (NLMSG_OK(h, status)) {
 			int err;
 
+			rth->msgs++;
+
 			if (h->nlmsg_pid != rth->local.nl_pid ||
 			    h->nlmsg_seq != rth->dump) {
 				if (junk) {
@@ -193,6 +217,7 @@ int rtnl_dump_filter(struct rtnl_handle *rth,
 skip_it:
 			h = NLMSG_NEXT(h, status);
 		}
+		rth->stamp = next;
 		if (msg.msg_flags & MSG_TRUNC) {
 			fprintf(stderr, "Message truncated\n");
 			continue;
@@ -232,6 +257,7 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 		n->nlmsg_flags |= NLM_F_ACK;
 
 	status = sendmsg(rtnl->fd, &msg, 0);
+	rtnl->stamp = rtnl_now();
 
 	if (status < 0) {
 		perror("Cannot talk to rtnetlink");
@@ -258,6 +284,8 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 			fprintf(stderr, "sender address length == %d\n", msg.msg_namelen);
 			exit(1);
 		}
+		rtnl->recvs++;
+		rtnl->bytes += status;
 		for (h = (struct nlmsghdr*)buf; status >= sizeof(*h); ) {
 			int err;
 			int len = h->nlmsg_len;
@@ -272,6 +300,7 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 				exit(1);
 			}
 
+			rtnl->msgs++;
 			if (h->nlmsg_pid != rtnl->local.nl_pid ||
 			    h->nlmsg_seq != seq) {
 				if (junk) {
@@ -279,6 +308,9 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 					if (err < 0)
 						return err;
 				}
+				/* Stale reply, e.g. to an earlier request */
+				status -= NLMSG_ALIGN(len);
+				h = (struct nlmsghdr*)((char*)h + NLMSG_ALIGN(len));
 				continue;
 			}
 
@@ -12,6 +12,12 @@ struct rtnl_handle
 	struct sockaddr_nl	peer;
 	__u32			seq;
 	__u32			dump;
+	/* receive side accounting, for self-instrumentation */
+	__u32			recvs;
+	__u32			msgs;
+	__u64			bytes;
+	/* CLOCK_MONOTONIC ns the kernel filled the batch being parsed */
+	__u64			stamp;
 };
 
 extern int rtnl_open(struct rtnl_handle *rth, unsigned subscriptions);